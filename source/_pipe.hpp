@@ -10,8 +10,8 @@
 #include <system_error>  // system_error(), system_category(), errno
 
 extern "C" {
-#include <unistd.h>  // pipe2(), close(), dup2(), dup(), STDERR_FILENO
-#include <fcntl.h>  // O_CLOEXEC
+#include <unistd.h>  // pipe2(), close()
+#include <fcntl.h>  // fcntl(), O_CLOEXEC, F_SETPIPE_SZ, F_DUPFD_CLOEXEC
 }
 
 
@@ -20,13 +20,15 @@ extern "C" {
 // a child process can be associated with.
 // - _pipe<>(-1) creates a pipe with new fds allocated by system, and _pipe<>(fd) creates 
 //   a redirection to the specified fd (fd >= 0).
+// - _pipe<>(-1, capacity) asks system for the pipe of the given capacity (in bytes).
+// - _pipe<>(fd)._own() takes over fd (e.g, a memory file created for the child) as if 
+//   it were a pipe created, closing it on destruction or handing it over by release().
 // - _pipe<false>() for child process's stdin, and _pipe<true>() is for child process's 
 //   stdout/stderr.
 // - _pipe<>::~_pipe() removes the created pipe, or does nothing for redirection.
-// - _pipe<>::dup2(fd) links/redirects the given fd (of stdin/stdout/stderr) of child 
-//   process to the pipe or to the redirection's fd.
-// - _pipe<>::dup2() is used for duplicating a fd, when exchaning stdout and stderr of 
-//   child process.
+// - Linking/redirecting the stdin/stdout/stderr of child process to near is done by 
+//   process::_exec() in child process, which, to be safe to run after vfork, works only 
+//   on its own copies of nears and never throws.
 
 template <bool Behind>
 // "Behind" is true if pipe locates behind child process, or false if ahead of child.
@@ -44,7 +46,8 @@ protected:
 	// far end of pipe from child process, or -1 for redirection
 
     // No copy/move constructor/assignment provided.
-    _pipe(int fd);  // will create a pipe if fd < 0, or a redirection otherwise.
+    _pipe(int fd, int capacity =0);
+	// will create a pipe if fd < 0, or a redirection otherwise.
     ~_pipe() { close(); }  // remove the pipe, or do nothing for redirection.
 	// Note that pipe gets deleted discarding any remaining data in it, when all fds 
 	// associated with the pipe are closed.
@@ -52,15 +55,12 @@ protected:
     // operations for parent process
     void _close_near(); // close near for the pipe created.
     void close();	// close near and far for the pipe created.
-
-    // opeartions for child process
-    void dup2(int fd);  // link/redirect the given fd to near.
-    void dup2();	// duplicate near and overwrite near.
-    void _close();	// close near and far forcilby (if >= 0).
+    int release();	// close near and hand far over to the caller.
+    void _own();	// have far a duplicate of near, or close near and throw.
 };
 
 template <bool Behind>
-_pipe<Behind>::_pipe(int fd)
+_pipe<Behind>::_pipe(int fd, int capacity)
 {
     if ( fd >= 0 )
 	near = fd;
@@ -71,6 +71,11 @@ _pipe<Behind>::_pipe(int fd)
 	// process unless specified for redirection target of child process.
 	throw std::system_error(errno, std::system_category());
 
+    else if ( capacity > 0 )
+	::fcntl(far, F_SETPIPE_SZ, capacity);
+	// We ignore failure (e.g, EPERM for exceeding the limit of unprivileged user), 
+	// in which case the pipe just keeps the default capacity.
+
     // We always have near >= 0 here, but far may or may not be >= 0, and
     // near and far are unique if far >= 0.
 }
@@ -99,39 +104,22 @@ void _pipe<Behind>::close()
 }
 
 template <bool Behind>
-void _pipe<Behind>::dup2(int fd)
+int _pipe<Behind>::release()
 {
-    if ( ::dup2(near, fd) == -1 )
-	// will yield -1 if near or fd < 0, and do nothing if near == fd.
-	throw std::system_error(errno, std::system_category());
-}
+    _close_near();
 
-template <bool Behind>
-void _pipe<Behind>::dup2()
-{
-    near = ::dup(near);
-    if ( near == -1 )
-	throw std::system_error(errno, std::system_category());
+    const int fd = far;
+    far = -1;  // so that ~_pipe() will not close it.
+    return fd;
 }
 
 template <bool Behind>
-inline void _pipe<Behind>::_close()
+void _pipe<Behind>::_own()
 {
-    if ( far < 0 && near > STDERR_FILENO )
-	// If far >= 0, we don't need to close near and far since they are both created 
-	// with O_CLOEXEC on and thus will be closed automatically on exec*().
+    if ( (far = ::fcntl(near, F_DUPFD_CLOEXEC, 0)) == -1 ) {
+	const int error = errno;
 	::close(near);
-	// may cause -1 error if some nears are the same, which we can ignore safely.
-
-    // When closing any near (or far), we do not set it here back to -1 to prevent it 
-    // from closing again, because the exec*() called from child process will replace the 
-    // whole parent process image with a new process image.
-
-/* Or, we could blindly close all:
-    if ( near > STDERR_FILENO )
-	::close(near);
-	// may cause -1 error if some nears are the same, which we can ignore safely.
-    if ( far > STDERR_FILENO )
-	::close(far);
-*/
+	near = -1;
+	throw std::system_error(error, std::system_category());
+    }
 }
@@ -0,0 +1,247 @@
+// async_writer: writing into fd (e.g, proc.stdin) in background without blocking writers
+//
+// - async_writer w { proc.stdin }; has a thread of its own writing into proc.stdin 
+//   whatever is queued by w.write(data). Many chunks queued are written at once by one 
+//   ::writev(), as much as the pipe can take without blocking.
+// - w.write(sv) queues sv (string_view) without copying it, so the data sv refers to 
+//   must be kept valid until written (e.g, until w.flush() or w.close() returns). 
+//   w.write(std::move(s)) queues string s, which async_writer keeps until written.
+// - Writers wait in w.write() only while more than the high watermark (1MB by default) 
+//   is queued and not yet written, until it falls down to the low watermark (256KB by 
+//   default). w.try_write() instead returns false without queuing.
+// - w.flush() waits for everything queued to be written, and w.close() (or destroying 
+//   w) closes the fd as well after flushing, like ofdstream does. Then child sees EOF.
+// - If child closes its stdin (EPIPE), everything queued and to be queued is discarded, 
+//   and w.broken() returns true. (SIGPIPE is blocked in the thread of async_writer, not 
+//   to kill the whole process.) Other errors are thrown as system_error by write(), 
+//   flush(), and close().
+//
+// The fd is made non-blocking, and the thread waits with ::poll() for the pipe to have 
+// room. So, a write() never blocks on a slow child, and a record of a few bytes does not 
+// cost a syscall of its own.
+
+
+
+#pragma once
+
+#include <algorithm>  // min()
+#include <condition_variable>  // condition_variable
+#include <deque>  // deque<>
+#include <mutex>  // mutex, lock_guard<>, unique_lock<>
+#include <string>  // string
+#include <string_view>  // string_view
+#include <system_error>  // system_error(), system_category(), errno
+#include <thread>  // thread
+
+#include <fcntl.h>  // fcntl(), O_NONBLOCK
+#include <limits.h>  // IOV_MAX
+#include <poll.h>  // poll(), POLLOUT
+#include <signal.h>  // pthread_sigmask(), sigtimedwait(), SIGPIPE
+#include <sys/uio.h>  // writev(), iovec
+#include <unistd.h>  // close()
+
+
+
+class async_writer {
+private:
+    struct _chunk {
+	std::string owned;  // if queued by write(std::string&&)
+	std::string_view view;
+    };
+
+    int _fd;
+    const size_t _high, _low;  // watermarks
+
+    std::mutex _mtx;
+    std::condition_variable _cv_queued;  // for the thread to wait for _queue
+    std::condition_variable _cv_written;  // for writers to wait for _queue to be written
+    std::deque<_chunk> _queue;  // Elements do not move while being pushed and popped.
+    size_t _queued = 0;  // bytes in _queue
+    size_t _offset = 0;  // bytes of _queue.front() written already
+    bool _full = false;  // true once _queued >= _high, until _queued <= _low
+    bool _closing = false;
+    bool _broken = false;
+    int _error = 0;
+
+    std::thread _thread;
+
+    void _run();
+    void _push(_chunk&& chunk);
+    void _check();  // throw if error
+
+public:
+    explicit async_writer(int fd, size_t high =1024 * 1024, size_t low =256 * 1024);
+
+    ~async_writer() { try { close(); } catch ( ... ) {} }
+
+    async_writer(const async_writer&) =delete;
+    async_writer& operator=(const async_writer&) =delete;
+
+    // queue data, waiting while too much is queued already.
+    void write(std::string_view data);
+    void write(std::string&& data);
+
+    // queue data unless too much is queued already, returning false if so.
+    bool try_write(std::string_view data);
+
+    // wait for everything queued to be written.
+    void flush();
+
+    // flush and close fd.
+    void close();
+
+    // return bytes queued and not written yet.
+    size_t queued() { std::lock_guard<std::mutex> lock(_mtx); return _queued; }
+
+    // return true if the other end of fd has been closed.
+    bool broken() { std::lock_guard<std::mutex> lock(_mtx); return _broken; }
+};
+
+async_writer::async_writer(int fd, size_t high, size_t low)
+:   _fd(fd), _high(high), _low(std::min(low, high))
+{
+    const int flags = ::fcntl(fd, F_GETFL);
+    if ( flags == -1 || ::fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1 )
+	throw std::system_error(errno, std::system_category());
+
+    _thread = std::thread(&async_writer::_run, this);
+}
+
+void async_writer::_check()
+{
+    if ( _error ) {
+	const int error = _error;
+	_error = 0;  // reported only once.
+	throw std::system_error(error, std::system_category());
+    }
+}
+
+void async_writer::_push(_chunk&& chunk)
+{
+    if ( _broken || _closing || (chunk.owned.empty() && chunk.view.empty()) )
+	return;
+
+    _queue.push_back(std::move(chunk));
+    _chunk& back = _queue.back();
+    if ( !back.owned.empty() )
+	back.view = back.owned;  // not before pushed, since SSO does not survive moving.
+    _queued += back.view.size();
+    if ( _queued >= _high )
+	_full = true;
+    _cv_queued.notify_one();
+}
+
+void async_writer::write(std::string_view data)
+{
+    std::unique_lock<std::mutex> lock(_mtx);
+    _cv_written.wait(lock, [this]{ return !_full || _error || _closing; });
+    _check();
+    _push({ {}, data });
+}
+
+void async_writer::write(std::string&& data)
+{
+    std::unique_lock<std::mutex> lock(_mtx);
+    _cv_written.wait(lock, [this]{ return !_full || _error || _closing; });
+    _check();
+    _push({ std::move(data), {} });
+}
+
+bool async_writer::try_write(std::string_view data)
+{
+    std::lock_guard<std::mutex> lock(_mtx);
+    _check();
+    if ( _full )
+	return false;
+    _push({ {}, data });
+    return true;
+}
+
+void async_writer::flush()
+{
+    std::unique_lock<std::mutex> lock(_mtx);
+    _cv_written.wait(lock, [this]{ return _queue.empty() || _error; });
+    _check();
+}
+
+void async_writer::close()
+{
+    {
+	std::lock_guard<std::mutex> lock(_mtx);
+	if ( _fd == -1 )
+	    return;
+	_closing = true;  // The thread exits after writing everything queued.
+	_cv_queued.notify_one();
+    }
+    _thread.join();
+
+    ::close(_fd);  // to let child see EOF.
+    _fd = -1;
+    std::lock_guard<std::mutex> lock(_mtx);
+    _check();
+}
+
+void async_writer::_run()
+{
+    // SIGPIPE is raised to this thread only, and we take it out if raised (by EPIPE).
+    sigset_t sigpipe;
+    ::sigemptyset(&sigpipe);
+    ::sigaddset(&sigpipe, SIGPIPE);
+    ::pthread_sigmask(SIG_BLOCK, &sigpipe, nullptr);
+
+    std::unique_lock<std::mutex> lock(_mtx);
+    for ( ;; ) {
+	_cv_queued.wait(lock, [this]{ return !_queue.empty() || _closing; });
+	if ( _queue.empty() )
+	    break;  // closing
+
+	// Gather as many chunks as writev() takes. Writers can push more chunks while we 
+	// are writing these, but it does not move the chunks.
+	iovec iov[IOV_MAX];
+	int iovcnt = 0;
+	for ( const _chunk& chunk: _queue ) {
+	    const size_t offset = iovcnt == 0 ? _offset : 0;
+	    iov[iovcnt++] = { const_cast<char*>(chunk.view.data()) + offset,
+		chunk.view.size() - offset };
+	    if ( iovcnt == IOV_MAX )
+		break;
+	}
+	lock.unlock();
+
+	ssize_t n = ::writev(_fd, iov, iovcnt);
+	if ( n == -1 && errno == EAGAIN ) {
+	    pollfd pfd { _fd, POLLOUT, 0 };
+	    ::poll(&pfd, 1, -1);  // POLLERR if closed, which writev() detects next time.
+	}
+	const int error = n == -1 ? errno : 0;
+
+	lock.lock();
+	if ( error == EPIPE ) {
+	    const struct timespec zero = {};
+	    ::sigtimedwait(&sigpipe, nullptr, &zero);
+	    _broken = true;
+	    n = _queued;  // discarding all
+	}
+	else if ( error && error != EAGAIN && error != EINTR ) {
+	    _error = error;
+	    n = _queued;
+	}
+
+	// Pop what has been written.
+	for ( size_t k = n > 0 ? n : 0 ; k > 0 ; ) {
+	    const size_t rest = _queue.front().view.size() - _offset;
+	    if ( k < rest ) {
+		_offset += k;
+		break;
+	    }
+	    k -= rest;
+	    _offset = 0;
+	    _queue.pop_front();
+	}
+	_queued -= n > 0 ? n : 0;
+	if ( _full && _queued <= _low )
+	    _full = false;
+	if ( n > 0 )
+	    _cv_written.notify_all();
+    }
+}
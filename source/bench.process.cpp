@@ -0,0 +1,215 @@
+// clang++ -O2 bench.process.cpp -lpthread
+//
+// Benchmarks of the hot paths, each printing one JSON object per line, e.g.
+//   {"bench": "spawn", "backend": "vfork", "rss_mb": 1024, "ops_per_sec": 2415.3} 
+// so that results can be compared between builds (e.g, with jq) to catch regressions.
+// - spawn: spawn and wait() for /bin/true, with each backend at growing RSS of parent.
+// - pipe: throughput of ofdstream -> cat -> ifdstream with small writes, by bufsize.
+// - exit_latency: from child's exit until wait(), wait(timeout), or poll() returns.
+// - contention: many threads waiting for (or polling) one process at the same time.
+//
+// ./a.out --quick runs fewer iterations at smaller RSS, e.g. for CI.
+
+
+
+#include "process.hpp"
+#include "fdstream.hpp"
+#include "zygote.hpp"
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <memory>
+
+extern "C" {
+#include <poll.h>
+}
+
+using namespace std::chrono;
+using namespace std::chrono_literals;
+
+static bool quick = false;
+
+static double seconds_since(steady_clock::time_point t0)
+{
+    return duration<double>(steady_clock::now() - t0).count();
+}
+
+static double median(std::vector<double> v)
+{
+    std::sort(v.begin(), v.end());
+    return v.empty() ? 0 : v[v.size() / 2];
+}
+
+static double percentile(std::vector<double> v, double p)
+{
+    std::sort(v.begin(), v.end());
+    return v.empty() ? 0 : v[std::min(v.size() - 1, static_cast<size_t>(v.size() * p))];
+}
+
+
+
+// spawn and wait for /bin/true n times with each backend, at the current RSS.
+static void bench_spawn(size_t rss_mb)
+{
+    static const struct { process::backend_t backend; const char* name; } backends[] = {
+	{ process::FORK, "fork" }, { process::VFORK, "vfork" }, { process::ZYGOTE, "zygote" } };
+    static const char* const argv[] = { "/bin/true", nullptr };
+
+    const int n = quick ? 50 : 500;
+    for ( const auto& each: backends ) {
+	process::backend = each.backend;
+	const auto t0 = steady_clock::now();
+	for ( int i = 0 ; i < n ; ++i )
+	    process { process::DEVNULL, argv, process::DEVNULL, process::DEVNULL }.wait();
+	std::printf("{\"bench\": \"spawn\", \"backend\": \"%s\", \"rss_mb\": %zu, "
+	    "\"ops_per_sec\": %.1f}\n", each.name, rss_mb, n / seconds_since(t0));
+    }
+    process::backend = process::FORK;
+}
+
+// write total bytes (in lines of 64 bytes) into cat through ofdstream, reading them back 
+// through ifdstream, both with bufsize.
+static void bench_pipe(size_t bufsize)
+{
+    const size_t total = ( quick ? 64 : 512 ) << 20;
+    process cat { process::PIPE, { "cat" }, process::PIPE };
+
+    std::thread writer { [&, fd = ::dup(cat.stdin)]() {
+	ofdstream out { fd, bufsize };
+	char line[64];
+	std::memset(line, 'x', sizeof(line) - 1);
+	line[sizeof(line) - 1] = '\n';
+	for ( size_t n = 0 ; n < total ; n += sizeof(line) )
+	    out.write(line, sizeof(line));
+    } };
+    ::close(cat.stdin);  // which writer has a dup of, to close when done
+
+    const auto t0 = steady_clock::now();
+    ifdstream in { ::dup(cat.stdout), bufsize };
+    char buf[4096];
+    size_t got = 0;
+    while ( in.read(buf, sizeof(buf)) || in.gcount() > 0 )
+	got += in.gcount();
+    const double elapsed = seconds_since(t0);
+
+    writer.join();
+    cat.wait();
+    std::printf("{\"bench\": \"pipe\", \"bufsize\": %zu, \"bytes\": %zu, "
+	"\"mb_per_sec\": %.1f}\n", bufsize, got, got / elapsed / (1 << 20));
+}
+
+// latency from child's exit (noticed by POLLHUP of its stdout in another thread) until 
+// waiting for it returns, by how.
+static void bench_exit_latency(const char* how)
+{
+    std::vector<double> latencies;
+    const int n = quick ? 20 : 200;
+    for ( int i = 0 ; i < n ; ++i ) {
+	process proc { { "sleep", "0.005" }, process::PIPE };
+
+	steady_clock::time_point exited;
+	std::thread watcher { [&]() {
+	    struct pollfd pfd = { proc.stdout, POLLIN, 0 };
+	    ::poll(&pfd, 1, -1);  // POLLHUP as soon as child exits.
+	    exited = steady_clock::now();
+	} };
+
+	if ( std::strcmp(how, "wait") == 0 )
+	    proc.wait();
+	else if ( std::strcmp(how, "wait_timeout") == 0 )
+	    while ( !proc.wait(1s) ) {}
+	else
+	    while ( !proc.poll() ) {}
+	const auto returned = steady_clock::now();
+
+	watcher.join();
+	latencies.push_back(duration<double, std::micro>(returned - exited).count());
+    }
+    std::printf("{\"bench\": \"exit_latency\", \"how\": \"%s\", \"p50_us\": %.1f, "
+	"\"p99_us\": %.1f}\n", how, median(latencies), percentile(latencies, 0.99));
+}
+
+// threads waiting for (or polling) one process at the same time: the rate of poll()s 
+// while it runs, and the latency until all of them have returned once it exits.
+static void bench_contention(int threads, bool polling)
+{
+    process proc { { "sleep", "0.2" }, process::PIPE };
+
+    steady_clock::time_point exited;
+    std::vector<steady_clock::time_point> returned(threads);
+    std::vector<long> polls(threads);
+    std::vector<std::thread> waiters;
+    for ( int i = 0 ; i < threads ; ++i )
+	waiters.emplace_back([&, i]() {
+	    if ( polling ) {
+		long n = 0;  // not to share cache lines of polls[] while polling
+		for ( ; !proc.poll() ; ++n ) {}
+		polls[i] = n;
+	    }
+	    else
+		proc.wait();
+	    returned[i] = steady_clock::now();
+	});
+
+    struct pollfd pfd = { proc.stdout, POLLIN, 0 };
+    ::poll(&pfd, 1, -1);
+    exited = steady_clock::now();
+    for ( auto& each: waiters )
+	each.join();
+
+    const auto last = *std::max_element(returned.begin(), returned.end());
+    long total = 0;
+    for ( long each: polls )
+	total += each;
+    std::printf("{\"bench\": \"contention\", \"how\": \"%s\", \"threads\": %d, "
+	"\"all_returned_us\": %.1f, \"polls_per_sec\": %.0f}\n", polling ? "poll" : "wait",
+	threads, duration<double, std::micro>(last - exited).count(),
+	polling ? total / 0.2 : 0.0);
+
+    // Once done, poll() is a single load, which every thread can do without contention.
+    const int n = 1000000;
+    const auto t0 = steady_clock::now();
+    for ( int i = 0 ; i < n ; ++i )
+	if ( !proc.poll() )
+	    std::abort();
+    std::printf("{\"bench\": \"poll_done\", \"ns_per_poll\": %.2f}\n",
+	seconds_since(t0) * 1e9 / n);
+}
+
+
+
+int main(int argc, char* argv[])
+{
+    quick = argc > 1 && std::strcmp(argv[1], "--quick") == 0;
+
+    zygote::start();  // while we are still small
+
+    std::vector<std::unique_ptr<char[]>> heap;
+    size_t rss_mb = 0;
+    for ( size_t target: { 0, 256, 1024, 4096 } ) {
+	if ( quick && target > 256 )
+	    break;
+	for ( ; rss_mb < target ; rss_mb += 64 ) {
+	    heap.emplace_back(new char[64 << 20]);
+	    std::memset(heap.back().get(), 1, 64 << 20);  // to be resident
+	}
+	bench_spawn(rss_mb);
+    }
+    heap.clear();
+
+    for ( size_t bufsize: { 0, 512, 4096, 65536 } )
+	bench_pipe(bufsize);
+
+    for ( const char* how: { "wait", "wait_timeout", "poll" } )
+	bench_exit_latency(how);
+
+    for ( int threads: { 2, 8, 32 } ) {
+	bench_contention(threads, false);
+	bench_contention(threads, true);
+    }
+
+    zygote::stop();
+}
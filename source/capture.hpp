@@ -0,0 +1,57 @@
+// capture: run a command to the end and capture its stdout, stderr, and exitcode
+//
+// - capture c { "ls", "-l" }; runs "ls -l" and waits for it to terminate, having c.out, 
+//   c.err, and c.exitcode. Or, auto [out, err, exitcode] = capture{ "ls", "-l" };
+// - capture c ( { "sort" }, input ); writes input into its stdin as well. (Note the 
+//   parentheses. capture c { { "sort" }, input } would take input as an argument.)
+// - c.run(args, input) runs another command, reusing the memory of c.out and c.err.
+// - bool(c) is true if the command succeeded (with exitcode of 0).
+//
+// stdout and stderr are read at the same time by process::communicate(), not to 
+// deadlock if either pipe is filled up, and directly into out and err without any 
+// intermediate buffer.
+
+
+
+#pragma once
+
+#include "process.hpp"
+// <string>: string, .c_str(), .clear()
+// <string_view>: string_view
+// <vector>: vector<>, .push_back(), .data()
+// <initializer_list>: initializer_list<>
+
+
+
+struct capture {
+    std::string out;
+    std::string err;
+    int exitcode = process::UNKNOWN;
+
+    capture() {}  // to run later
+
+    capture(std::initializer_list<std::string> args) { run(args); }
+
+    explicit capture(const std::vector<std::string>& args, std::string_view input ={})
+    { run(args, input); }
+
+    capture& run(const std::vector<std::string>& args, std::string_view input ={});
+
+    explicit operator bool() const { return exitcode == 0; }
+};
+
+capture& capture::run(const std::vector<std::string>& args, std::string_view input)
+{
+    std::vector<const char*> argv;
+    for ( const auto& each: args )
+	argv.push_back(each.c_str());
+    argv.push_back(nullptr);
+
+    out.clear();  // keeping the capacity
+    err.clear();
+    process proc { input.empty() ? process::DEVNULL : process::PIPE, argv.data(),
+	process::PIPE, process::PIPE };
+    proc.communicate(input, out, err);
+    exitcode = proc.exitcode;
+    return *this;
+}
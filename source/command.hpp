@@ -0,0 +1,185 @@
+// command: a command prepared once to be spawned many times without allocating memory
+//
+// - command cmd { "grep", "-c", "foo" }; copies the arguments into one contiguous block 
+//   along with argv pointing into it, and process proc { cmd }; spawns it as many times 
+//   as needed, just like process proc { { "grep", "-c", "foo" } }; but without building 
+//   argv again.
+// - command cmd { fd0, args, fd1, fd2 }; (or cmd { args, fd1, fd2 }) has the 
+//   redirections for stdin/stdout/stderr prepared as well, which can be process::PIPE to 
+//   create new pipes at each spawn.
+// - cmd.env({ "LANG=C", ... }) has child process run with the environment given, 
+//   instead of inheriting ours, and cmd.cwd(dir) has it run in dir.
+// - static constexpr argv_literal ls { "ls", "-l" }; builds argv of string literals at 
+//   compile time, which command cmd { ls }; or process proc { process::DEVNULL, ls.argv, 
+//   process::PIPE, process::DEVNULL }; spawns without copying anything. (ls should be 
+//   kept alive while cmd is, which static does.)
+//
+// command is movable but not copyable, since argv points into its own block.
+
+
+
+#pragma once
+
+#include "process.hpp"
+// <string>: string
+// <string_view>: string_view
+// <vector>: vector<>, .push_back()
+// <initializer_list>: initializer_list<>
+
+#include <cstring>  // memcpy()
+#include <memory>  // unique_ptr<>
+
+
+
+// argv of N string literals, built at compile time
+template <size_t N>
+struct argv_literal {
+    const char* argv[N + 1];  // terminated by nullptr
+
+    template <typename... Args>
+    constexpr argv_literal(const Args&... args): argv { args..., nullptr } {}
+};
+
+template <typename... Args>
+argv_literal(const Args&...) -> argv_literal<sizeof...(Args)>;
+
+
+
+class command {
+    friend class process;
+
+private:
+    std::unique_ptr<const char*[]> _block;  // argv, envp, and the strings they point to
+    const char* const* _argv = nullptr;
+    const char* const* _envp = nullptr;  // nullptr to inherit environ
+    const char* _cwd = nullptr;  // nullptr to run in our cwd
+    int _fds[3];
+
+    // return the strings that v (terminated by nullptr) points to.
+    static std::vector<std::string_view> _views(const char* const* v);
+
+    // build _block from scratch with args, envs (if not nullptr), and dir (if not 
+    // nullptr), for the pointers to point into.
+    void _build(const std::vector<std::string_view>& args,
+	const std::vector<std::string_view>* envs, const std::string_view* dir);
+
+public:
+    explicit command( int fd0, std::initializer_list<std::string_view> args,
+	int fd1 =process::DEVNULL, int fd2 =process::DEVNULL )
+    : _fds { fd0, fd1, fd2 } { _build(args, nullptr, nullptr); }
+
+    explicit command( std::initializer_list<std::string_view> args,
+	int fd1 =process::DEVNULL, int fd2 =process::DEVNULL )
+    : command(process::DEVNULL, args, fd1, fd2) {}
+
+    explicit command( int fd0, const std::vector<std::string>& args,
+	int fd1 =process::DEVNULL, int fd2 =process::DEVNULL )
+    : _fds { fd0, fd1, fd2 } { _build({ args.begin(), args.end() }, nullptr, nullptr); }
+
+    explicit command( const std::vector<std::string>& args,
+	int fd1 =process::DEVNULL, int fd2 =process::DEVNULL )
+    : command(process::DEVNULL, args, fd1, fd2) {}
+
+    // command of argv_literal, pointing to lit.argv without copying
+    template <size_t N>
+    explicit command( int fd0, const argv_literal<N>& lit,
+	int fd1 =process::DEVNULL, int fd2 =process::DEVNULL )
+    : _argv(lit.argv), _fds { fd0, fd1, fd2 } {}
+
+    template <size_t N>
+    explicit command( const argv_literal<N>& lit,
+	int fd1 =process::DEVNULL, int fd2 =process::DEVNULL )
+    : command(process::DEVNULL, lit, fd1, fd2) {}
+
+    // set the environment (each of "NAME=value") for child process.
+    command& env(std::initializer_list<std::string_view> envs);
+    command& env(const std::vector<std::string>& envs);
+
+    // set the working directory for child process.
+    command& cwd(std::string_view dir);
+
+    const char* const* argv() const { return _argv; }
+    const char* const* envp() const { return _envp; }  // or nullptr if not set
+};
+
+std::vector<std::string_view> command::_views(const char* const* v)
+{
+    std::vector<std::string_view> result;
+    while ( v && *v )
+	result.push_back(*v++);
+    return result;
+}
+
+void command::_build(const std::vector<std::string_view>& args,
+    const std::vector<std::string_view>* envs, const std::string_view* dir)
+{
+    // The block has the pointers first and then the strings, all in one allocation.
+    size_t ptrs = args.size() + 1 + ( envs ? envs->size() + 1 : 0 );
+    size_t chars = dir ? dir->size() + 1 : 0;
+    for ( const auto& each: args )
+	chars += each.size() + 1;
+    if ( envs )
+	for ( const auto& each: *envs )
+	    chars += each.size() + 1;
+
+    std::unique_ptr<const char*[]> block {
+	new const char*[ptrs + (chars + sizeof(char*) - 1) / sizeof(char*)] };
+    const char** ptr = &block[0];
+    char* chr = reinterpret_cast<char*>(&block[ptrs]);
+    const auto put = [&chr](std::string_view s) {
+	const char* const p = chr;
+	std::memcpy(chr, s.data(), s.size());
+	chr += s.size();
+	*chr++ = '\0';
+	return p;
+    };
+
+    _argv = ptr;
+    for ( const auto& each: args )
+	*ptr++ = put(each);
+    *ptr++ = nullptr;
+
+    _envp = nullptr;
+    if ( envs ) {
+	_envp = ptr;
+	for ( const auto& each: *envs )
+	    *ptr++ = put(each);
+	*ptr++ = nullptr;
+    }
+
+    _cwd = dir ? put(*dir) : nullptr;
+    _block = std::move(block);  // Only now are the old strings (args, ...) released.
+}
+
+command& command::env(std::initializer_list<std::string_view> envs)
+{
+    const std::vector<std::string_view> e { envs };
+    const std::string_view dir = _cwd ? _cwd : "";
+    _build(_views(_argv), &e, _cwd ? &dir : nullptr);
+    return *this;
+}
+
+command& command::env(const std::vector<std::string>& envs)
+{
+    const std::vector<std::string_view> e { envs.begin(), envs.end() };
+    const std::string_view dir = _cwd ? _cwd : "";
+    _build(_views(_argv), &e, _cwd ? &dir : nullptr);
+    return *this;
+}
+
+command& command::cwd(std::string_view dir)
+{
+    const std::vector<std::string_view> e = _views(_envp);
+    _build(_views(_argv), _envp ? &e : nullptr, &dir);
+    return *this;
+}
+
+process::process(const command& cmd)
+:   process(cmd, options())
+{}
+
+process::process(const command& cmd, const options& opts)
+:   process_handle(_own_usage)
+{
+    _start(cmd._fds[0], cmd._fds[1], cmd._fds[2], cmd._argv, cmd._envp, cmd._cwd, opts);
+}
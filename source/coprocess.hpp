@@ -0,0 +1,395 @@
+// coprocess: a long-lived child process serving requests framed over its stdin/stdout
+//
+// - coprocess<> co { { "sed", "-u", "s/.*/\\U&/" } }; spawns the command once, with 
+//   its stdin and stdout piped, to serve requests of one line each (by line_framing).
+// - co.call(request, response) sends request and receives its response, setting 
+//   response (of string_view) to refer to the response kept in co, which stays valid 
+//   until the next send(), receive(), or call() of co.
+// - co.send(request) just queues request, and co.receive(response) receives the 
+//   response to the oldest request not received yet. So, many requests can be in flight 
+//   at once, which child process serves without waiting for a round trip for each, and 
+//   their responses are received in the same order.
+// - If child process terminates (e.g, crashes) or closes its stdout, the requests in 
+//   flight are lost, for each of which receive() returns false, and the command is 
+//   spawned again for the requests that follow. co.restarts() tells how many times.
+// - coprocess<nul_framing> and coprocess<length_framing> frame messages by '\0' and by 
+//   a 4-byte big-endian length before each, instead of '\n'. Any class with put() and 
+//   get() like delimited_framing<> below can be a framing.
+// - coprocess_pool<> pool { N, { "sed", "-u", "s/.*/\\U&/" } }; keeps N of the same 
+//   coprocesses, and pool.acquire() leases one not in use (waiting if all are), which 
+//   goes back to pool as the lease is destroyed.
+//
+// Requests are framed into a buffer, which is written to child only when receive() 
+// needs a response or when 64KB is queued, while whatever child writes back meanwhile 
+// is read into another buffer, so that neither of us blocks on a full pipe. Responses 
+// are read as much as available at a time, and returned as views into the buffer. So, 
+// once the buffers have grown, requests cost no memory allocation, and a batch of them 
+// costs a few system calls.
+//
+// Note the command should write each response right away (e.g, "sed -u", "grep 
+// --line-buffered", or "stdbuf -oL"), or its responses would stay buffered in the 
+// command forever.
+
+
+
+#pragma once
+
+#include "process.hpp"
+// <chrono>: chrono::seconds
+// <string>: string, .append(), .push_back(), .find(), .clear(), .erase()
+// <string_view>: string_view, .substr()
+// <system_error>: system_error(), system_category(), errno
+// <vector>: vector<>, .push_back(), .data()
+// <fcntl.h>: fcntl(), O_NONBLOCK
+// <signal.h>: pthread_sigmask(), sigpending(), sigtimedwait(), SIGPIPE, SIGKILL
+// <poll.h>: poll(), POLLIN, POLLOUT
+
+#include "reaper.hpp"  // reaper::adopt()
+
+#include <condition_variable>  // condition_variable
+#include <cstdint>  // uint32_t, uint8_t
+#include <list>  // list<>, .emplace_back()
+#include <mutex>  // mutex, lock_guard<>, unique_lock<>
+
+
+
+// delimited_framing<D> frames each message by D after it, where the message should not 
+// contain D.
+template <char Delimiter>
+struct delimited_framing {
+    // append msg framed to buf.
+    static void put(std::string& buf, std::string_view msg)
+    { buf.append(msg.data(), msg.size()); buf.push_back(Delimiter); }
+
+    // set msg to the message of buf if buf begins with a whole frame, returning the size 
+    // of the frame, or return 0 if not (yet).
+    static size_t get(std::string_view buf, std::string_view& msg) {
+	const size_t end = buf.find(Delimiter);
+	if ( end == std::string_view::npos )
+	    return 0;
+	msg = buf.substr(0, end);
+	return end + 1;
+    }
+};
+
+using line_framing = delimited_framing<'\n'>;
+using nul_framing = delimited_framing<'\0'>;
+
+// length_framing frames each message by its length (as a 4-byte big-endian integer) 
+// before it, so that the message can contain anything.
+struct length_framing {
+    static void put(std::string& buf, std::string_view msg) {
+	const uint32_t n = msg.size();
+	const char header[4] = { char(n >> 24), char(n >> 16), char(n >> 8), char(n) };
+	buf.append(header, 4);
+	buf.append(msg.data(), msg.size());
+    }
+
+    static size_t get(std::string_view buf, std::string_view& msg) {
+	if ( buf.size() < 4 )
+	    return 0;
+	const auto byte = [&buf](int i) { return uint32_t(uint8_t(buf[i])); };
+	const size_t n = byte(0) << 24 | byte(1) << 16 | byte(2) << 8 | byte(3);
+	if ( buf.size() < 4 + n )
+	    return 0;
+	msg = buf.substr(4, n);
+	return 4 + n;
+    }
+};
+
+
+
+template <typename Framing =line_framing>
+class coprocess {
+public:
+    // spawn the command of args, with its stderr redirected to fd2 (as for process), 
+    // throwing system_error if failed.
+    explicit coprocess(std::vector<std::string> args, int fd2 =process::DEVNULL,
+	process::options opts ={});
+
+    // close stdin (so that the command sees EOF), and have reaper reap child process, 
+    // which gets killed if still running after a second, without waiting for it here.
+    ~coprocess();
+
+    // coprocess is not copyable nor movable.
+    coprocess(const coprocess&) =delete;
+    coprocess& operator=(const coprocess&) =delete;
+
+    // queue request, spawning the command again if it has terminated.
+    void send(std::string_view request);
+
+    // receive the response to the oldest request not received yet, returning false if 
+    // it was lost as child process terminated (or if no request is in flight).
+    bool receive(std::string_view& response);
+
+    bool call(std::string_view request, std::string_view& response)
+    { send(request); return receive(response); }
+
+    size_t in_flight() const { return _in_flight + _lost; }  // requests not received yet
+    size_t restarts() const { return _restarts; }
+    pid_t pid() const { return _proc.pid(); }  // of child process, or 0 if terminated
+
+private:
+    const std::vector<std::string> _args;
+    std::vector<const char*> _argv;  // of _args
+    const int _fd2;
+    const process::options _opts;
+    process_handle _proc;  // without child process once terminated, until sent again
+
+    std::string _wbuf;	// requests framed but not written yet (from _wpos)
+    size_t _wpos = 0;
+    std::string _rbuf;	// responses read but not received yet (from _rpos)
+    size_t _rpos = 0;
+
+    size_t _in_flight = 0;  // requests sent to _proc and not received yet
+    size_t _lost = 0;  // requests lost with child processes terminated, not received yet
+    size_t _restarts = 0;
+    bool _dead = false;  // if _proc has closed its stdin or stdout, until _lose()
+
+    static constexpr size_t HIGH = 64 * 1024;  // bytes of _wbuf to start writing at
+
+    void _spawn();
+
+    // write _wbuf into stdin of child process while reading its stdout into _rbuf, until 
+    // _wbuf is all written, and (if until_read) until anything is read as well, 
+    // returning false if child process has closed its stdin or stdout.
+    bool _pump(bool until_read);
+
+    // lose requests in flight, and reap child process (killing it if still running).
+    void _lose();
+};
+
+template <typename Framing>
+coprocess<Framing>::coprocess(std::vector<std::string> args, int fd2,
+    process::options opts)
+:   _args { std::move(args) }, _fd2 { fd2 }, _opts { std::move(opts) }
+{
+    for ( const auto& each: _args )
+	_argv.push_back(each.c_str());
+    _argv.push_back(nullptr);
+
+    _spawn();
+}
+
+template <typename Framing>
+coprocess<Framing>::~coprocess()
+{
+    using namespace std::chrono_literals;
+
+    if ( _proc._pid != 0 ) {
+	::close(_proc._stdin);
+	_proc._stdin = -1;
+	reaper::adopt(_proc, 1s, 1s);
+	// Reaper still reaps child process (or kills it) after _proc is destroyed.
+    }
+}
+
+template <typename Framing>
+void coprocess<Framing>::_spawn()
+{
+    _proc = process { process::PIPE, _argv.data(), process::PIPE, _fd2, _opts };
+
+    // Our ends of the pipes are made non-blocking, which child does not see.
+    for ( const int fd: { _proc._stdin, _proc._stdout } )
+	::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+template <typename Framing>
+void coprocess<Framing>::send(std::string_view request)
+{
+    if ( _proc._pid == 0 ) {
+	_spawn();
+	++_restarts;
+    }
+
+    Framing::put(_wbuf, request);
+    ++_in_flight;
+
+    if ( !_dead && _wbuf.size() - _wpos >= HIGH && !_pump(false) )
+	_dead = true;
+}
+
+template <typename Framing>
+bool coprocess<Framing>::receive(std::string_view& response)
+{
+    for ( ; ; ) {
+	if ( _lost > 0 ) {
+	    --_lost;
+	    return false;
+	}
+	if ( _in_flight == 0 )
+	    return false;
+
+	std::string_view msg;
+	if ( const size_t n = Framing::get(std::string_view(_rbuf).substr(_rpos), msg) ) {
+	    _rpos += n;
+	    --_in_flight;
+	    response = msg;
+	    return true;
+	}
+
+	// Responses read before child process terminated are still received above.
+	if ( _dead )
+	    _lose();
+	else if ( !_pump(true) )
+	    _dead = true;
+    }
+}
+
+template <typename Framing>
+bool coprocess<Framing>::_pump(bool until_read)
+{
+    // Writing into stdin that child process has closed will raise SIGPIPE, which is 
+    // blocked and taken out as in process::communicate().
+    sigset_t sigpipe, oldmask, pending;
+    ::sigemptyset(&sigpipe);
+    ::sigaddset(&sigpipe, SIGPIPE);
+    ::pthread_sigmask(SIG_BLOCK, &sigpipe, &oldmask);
+    ::sigpending(&pending);
+    const bool was_pending = ::sigismember(&pending, SIGPIPE);
+    bool epipe = false;
+
+    bool alive = true;
+    bool read = false;
+    while ( alive && (_wpos < _wbuf.size() || (until_read && !read)) ) {
+	struct pollfd pfds[2] = {
+	    { _wpos < _wbuf.size() ? _proc._stdin : -1, POLLOUT, 0 },
+	    { _proc._stdout, POLLIN, 0 } };
+	if ( ::poll(pfds, 2, -1) == -1 ) {
+	    if ( errno == EINTR )
+		continue;
+	    alive = false;  // cannot happen unless out of memory.
+	    break;
+	}
+
+	if ( pfds[0].revents ) {
+	    const ssize_t k = ::write(_proc._stdin, &_wbuf[_wpos], _wbuf.size() - _wpos);
+	    if ( k > 0 )
+		_wpos += k;
+	    else if ( k == -1 && errno != EAGAIN && errno != EINTR ) {
+		epipe = errno == EPIPE;
+		alive = false;
+	    }
+	}
+
+	if ( pfds[1].revents ) {
+	    // Responses received are dropped here, which are not referred to any more.
+	    if ( _rpos == _rbuf.size() || _rpos >= _rbuf.size() / 2 ) {
+		_rbuf.erase(0, _rpos);
+		_rpos = 0;
+	    }
+
+	    const ssize_t k = process::_read_some(_proc._stdout, _rbuf);
+	    if ( k > 0 )
+		read = true;
+	    else if ( k == 0 || (errno != EAGAIN && errno != EINTR) )
+		alive = false;  // EOF
+	}
+    }
+
+    if ( _wpos == _wbuf.size() ) {
+	_wbuf.clear();	// keeping the capacity
+	_wpos = 0;
+    }
+
+    if ( epipe && !was_pending ) {
+	const struct timespec zero = {};
+	::sigtimedwait(&sigpipe, nullptr, &zero);
+    }
+    ::pthread_sigmask(SIG_SETMASK, &oldmask, nullptr);
+
+    return alive;
+}
+
+template <typename Framing>
+void coprocess<Framing>::_lose()
+{
+    _lost += _in_flight;
+    _in_flight = 0;
+    _wbuf.clear();
+    _wpos = 0;
+    _rbuf.clear();
+    _rpos = 0;
+    _dead = false;
+
+    _proc.kill(SIGKILL);  // in case it has just closed its stdin or stdout
+    _proc.wait();
+    _proc = process_handle {};  // to be spawned again by the next send()
+}
+
+
+
+template <typename Framing =line_framing>
+class coprocess_pool {
+public:
+    // spawn n coprocesses of args (with fd2 and opts, as for coprocess).
+    coprocess_pool(size_t n, const std::vector<std::string>& args,
+	int fd2 =process::DEVNULL, const process::options& opts ={});
+
+    // coprocess_pool is not copyable nor movable.
+    coprocess_pool(const coprocess_pool&) =delete;
+    coprocess_pool& operator=(const coprocess_pool&) =delete;
+
+    // exclusive use of a coprocess in pool, until destroyed
+    class lease {
+	friend class coprocess_pool;
+
+	coprocess_pool* _pool;
+	coprocess<Framing>* _co;
+
+	lease(coprocess_pool* pool, coprocess<Framing>* co): _pool { pool }, _co { co } {}
+
+    public:
+	lease(lease&& l): _pool { l._pool }, _co { l._co } { l._co = nullptr; }
+	~lease() { if ( _co ) _pool->_release(_co); }
+
+	coprocess<Framing>& operator*() const { return *_co; }
+	coprocess<Framing>* operator->() const { return _co; }
+    };
+
+    // lease a coprocess not in use, waiting until any is released if all are in use.
+    lease acquire();
+
+private:
+    std::list<coprocess<Framing>> _all;  // list<> since coprocess is not movable
+    std::vector<coprocess<Framing>*> _free;
+
+    std::mutex _mtx;  // mutex protecting _free
+    std::condition_variable _cv;  // waiters for _free not to be empty
+
+    void _release(coprocess<Framing>* co);
+};
+
+template <typename Framing>
+coprocess_pool<Framing>::coprocess_pool(size_t n, const std::vector<std::string>& args,
+    int fd2, const process::options& opts)
+{
+    for ( size_t i = 0 ; i < n ; ++i )
+	_free.push_back(&_all.emplace_back(args, fd2, opts));
+}
+
+template <typename Framing>
+typename coprocess_pool<Framing>::lease coprocess_pool<Framing>::acquire()
+{
+    std::unique_lock<std::mutex> lock { _mtx };
+    _cv.wait(lock, [this]() { return !_free.empty(); });
+
+    coprocess<Framing>* const co = _free.back();
+    _free.pop_back();
+    return lease { this, co };
+}
+
+template <typename Framing>
+void coprocess_pool<Framing>::_release(coprocess<Framing>* co)
+{
+    // Responses not received by the last user would be taken by the next user.
+    std::string_view discarded;
+    while ( co->in_flight() > 0 )
+	co->receive(discarded);
+
+    {
+	std::lock_guard<std::mutex> lock { _mtx };
+	_free.push_back(co);
+    }
+    _cv.notify_one();
+}
@@ -0,0 +1,198 @@
+// coroutine: C++20 awaitables for processes, driven by io_uring (see uring.hpp)
+//
+// - co_await proc.async_wait() suspends the coroutine until proc terminates, returning 
+//   its exitcode, without blocking any thread.
+// - co_await async_read(proc.stdout, buf) appends to buf what is available from 
+//   proc.stdout, returning the number of bytes read (or 0 if EOF).
+// - co_await async_write(proc.stdin, data) writes all data into proc.stdin.
+// - They throw system_error if failed (e.g, EPIPE from async_write() if child closed its 
+//   stdin, or ENOSYS from async_wait() of a process being waited for by others (e.g, 
+//   reaper) if pidfd is not supported, or ECANCELED if the ring has been destroyed).
+// - Each takes an executor as an optional last argument, which is any callable that 
+//   takes std::coroutine_handle<> to resume (e.g, [&](auto h) { asio::post(io, h); }). 
+//   The default inline_executor resumes the coroutine right in the thread of uring, 
+//   which should not be blocked for long then.
+// - They use a uring created at the first use (default_uring()), or the one given as 
+//   the first argument. (default_uring() throws system_error if io_uring is not 
+//   supported by system.)
+//
+// This way, thousands of children can be waited for and talked to by a handful of 
+// threads, since a coroutine waiting takes no thread, but only the single ::poll() on 
+// pidfd (or ::read() or ::write() on pipe) submitted to the ring.
+
+
+
+#pragma once
+
+#include "uring.hpp"
+// <string>: string, .size()
+// <string_view>: string_view
+// <system_error>: system_error(), system_category()
+
+#if __cplusplus >= 202002L && __has_include(<coroutine>)
+
+#include <coroutine>  // coroutine_handle<>
+
+
+
+struct inline_executor {
+    void operator()(std::coroutine_handle<> h) const { h.resume(); }
+};
+
+// return the uring used by default, creating it at the first call. (Processes it is 
+// waiting for as it gets destroyed at exit are released to be waited for as usual.)
+template <typename =void>  // bogus template to have the definition in .hpp
+uring& default_uring()
+{
+    static uring ring;
+    return ring;
+}
+
+
+
+template <typename Executor>
+class _wait_awaiter {
+private:
+    process_handle& _p;
+    uring& _ring;
+    Executor _ex;
+    int _error = 0;  // if failed to be notified
+
+public:
+    _wait_awaiter(process_handle& p, uring& ring, Executor ex)
+    : _p(p), _ring(ring), _ex(std::move(ex)) {}
+
+    bool await_ready() { return _p.poll(); }
+
+    bool await_suspend(std::coroutine_handle<> h) {
+	// Note *this may be gone as soon as h is resumed (even before submit() if other 
+	// thread submits at the same time), so each callback has a copy of _ex, and we do 
+	// not touch *this after queuing.
+	uring& ring = _ring;
+	if ( ring.watch(_p, [ex = _ex, h](int) mutable { ex(h); }) ) {
+	    ring.submit();
+	    return true;
+	}
+
+	// Some thread (or reaper) is waiting for _p already, so we just get notified of 
+	// its termination, without taking a thread for each.
+	try {
+	    if ( !ring.notify(_p, [this, ex = _ex, h](int error) mutable {
+		_error = error; ex(h); }) )
+		return false;  // reaped already, to be published soon
+	}
+	catch ( const std::system_error& e ) {
+	    _error = e.code().value();
+	    return false;
+	}
+	ring.submit();
+	return true;
+    }
+
+    int await_resume() {
+	if ( _error )
+	    throw std::system_error(_error, std::system_category());
+	_p.wait();  // which returns soon, as the child process has terminated.
+	return _p.exitcode();
+    }
+};
+
+template <typename Executor>
+auto process_handle::async_wait(Executor ex)
+{
+    return _wait_awaiter<Executor> { *this, default_uring(), std::move(ex) };
+}
+
+template <typename Executor>
+auto process_handle::async_wait(uring& ring, Executor ex)
+{
+    return _wait_awaiter<Executor> { *this, ring, std::move(ex) };
+}
+
+
+
+template <typename Executor>
+class _read_awaiter {
+private:
+    uring& _ring;
+    int _fd;
+    std::string& _buf;
+    Executor _ex;
+    size_t _size;  // of _buf before reading
+    int _error = 0;
+
+public:
+    _read_awaiter(uring& ring, int fd, std::string& buf, Executor ex)
+    : _ring(ring), _fd(fd), _buf(buf), _ex(std::move(ex)), _size(buf.size()) {}
+
+    bool await_ready() { return false; }
+
+    void await_suspend(std::coroutine_handle<> h) {
+	uring& ring = _ring;  // not to touch *this after queuing (see _wait_awaiter).
+	ring.read_some(_fd, _buf,
+	    [this, ex = _ex, h](int error) mutable { _error = error; ex(h); });
+	ring.submit();
+    }
+
+    size_t await_resume() {
+	if ( _error )
+	    throw std::system_error(_error, std::system_category());
+	return _buf.size() - _size;
+    }
+};
+
+template <typename Executor =inline_executor>
+auto async_read(uring& ring, int fd, std::string& buf, Executor ex ={})
+{
+    return _read_awaiter<Executor> { ring, fd, buf, std::move(ex) };
+}
+
+template <typename Executor =inline_executor>
+auto async_read(int fd, std::string& buf, Executor ex ={})
+{
+    return _read_awaiter<Executor> { default_uring(), fd, buf, std::move(ex) };
+}
+
+
+
+template <typename Executor>
+class _write_awaiter {
+private:
+    uring& _ring;
+    int _fd;
+    std::string_view _data;
+    Executor _ex;
+    int _error = 0;
+
+public:
+    _write_awaiter(uring& ring, int fd, std::string_view data, Executor ex)
+    : _ring(ring), _fd(fd), _data(data), _ex(std::move(ex)) {}
+
+    bool await_ready() { return _data.empty(); }
+
+    void await_suspend(std::coroutine_handle<> h) {
+	uring& ring = _ring;
+	ring.write(_fd, _data,
+	    [this, ex = _ex, h](int error) mutable { _error = error; ex(h); });
+	ring.submit();
+    }
+
+    void await_resume() {
+	if ( _error )
+	    throw std::system_error(_error, std::system_category());
+    }
+};
+
+template <typename Executor =inline_executor>
+auto async_write(uring& ring, int fd, std::string_view data, Executor ex ={})
+{
+    return _write_awaiter<Executor> { ring, fd, data, std::move(ex) };
+}
+
+template <typename Executor =inline_executor>
+auto async_write(int fd, std::string_view data, Executor ex ={})
+{
+    return _write_awaiter<Executor> { default_uring(), fd, data, std::move(ex) };
+}
+
+#endif  // C++20
@@ -0,0 +1,105 @@
+// environment: our environ with an overlay merged once, to be passed to many spawns
+//
+// - environment env { { "LANG=C", "TZ=UTC", "HISTFILE" } }; merges the overlay into a 
+//   copy of our environ, overriding each "NAME=value" given and removing each "NAME" 
+//   given without '=', and keeps the result as one block of envp.
+// - opts.envp = env.envp(); has process proc { ..., opts }; pass the block right to 
+//   execve() (or to zygote), so that the command runs with it without "env" or 
+//   "/bin/sh -c" in front of it, and without building the environment at each spawn.
+// - env.update() merges the overlay again, into environ as of now (e.g, after setenv()), 
+//   which invalidates the envp() returned before.
+// - env.get("TZ") returns the value of TZ in the block, or nullptr if not there.
+//
+// environment is movable but not copyable, since envp() points into its own block. The 
+// overlay is merged by names, keeping the order of environ and appending the rest of 
+// the overlay (where the latest of the same name wins). Note $PATH to search for the 
+// command is still ours, not the one in the block, as with command::env().
+
+
+
+#pragma once
+
+#include <cstring>  // memcpy(), strncmp()
+#include <initializer_list>  // initializer_list<>
+#include <memory>  // unique_ptr<>
+#include <string>  // string
+#include <string_view>  // string_view, .substr(), .find()
+#include <unordered_map>  // unordered_map<>, .find(), .reserve()
+#include <utility>  // move()
+#include <vector>  // vector<>, .push_back()
+
+extern "C" {
+#include <unistd.h>  // environ
+}
+
+
+
+class environment {
+private:
+    std::vector<std::string> _overlay;
+    std::unique_ptr<const char*[]> _block;  // envp and the strings it points to
+
+    // name of "NAME=value" (or of "NAME")
+    static std::string_view _name(std::string_view s) { return s.substr(0, s.find('=')); }
+
+public:
+    explicit environment(std::initializer_list<std::string_view> overlay)
+    : _overlay(overlay.begin(), overlay.end()) { update(); }
+
+    explicit environment(std::vector<std::string> overlay)
+    : _overlay(std::move(overlay)) { update(); }
+
+    // build the block again from environ and the overlay.
+    void update();
+
+    const char* const* envp() const { return _block.get(); }  // terminated by nullptr
+
+    const char* get(std::string_view name) const;
+};
+
+void environment::update()
+{
+    // The latest entry of each name in the overlay wins, by its index.
+    std::unordered_map<std::string_view, size_t> latest;
+    latest.reserve(_overlay.size());
+    for ( size_t i = 0 ; i < _overlay.size() ; ++i )
+	latest[_name(_overlay[i])] = i;
+
+    std::vector<std::string_view> entries;
+    for ( const char* const* p = environ ; p && *p ; ++p )
+	if ( latest.find(_name(*p)) == latest.end() )
+	    entries.push_back(*p);
+    for ( size_t i = 0 ; i < _overlay.size() ; ++i )
+	if ( latest[_name(_overlay[i])] == i
+	    && _overlay[i].find('=') != std::string::npos )  // or to be removed
+	    entries.push_back(_overlay[i]);
+
+    // The block has the pointers first and then the strings, all in one allocation, as 
+    // in command.
+    const size_t ptrs = entries.size() + 1;
+    size_t chars = 0;
+    for ( const auto& each: entries )
+	chars += each.size() + 1;
+
+    std::unique_ptr<const char*[]> block {
+	new const char*[ptrs + (chars + sizeof(char*) - 1) / sizeof(char*)] };
+    const char** ptr = &block[0];
+    char* chr = reinterpret_cast<char*>(&block[ptrs]);
+    for ( const auto& each: entries ) {
+	*ptr++ = chr;
+	std::memcpy(chr, each.data(), each.size());
+	chr += each.size();
+	*chr++ = '\0';
+    }
+    *ptr = nullptr;
+
+    _block = std::move(block);
+}
+
+const char* environment::get(std::string_view name) const
+{
+    for ( const char* const* p = envp() ; *p ; ++p )
+	if ( std::strncmp(*p, name.data(), name.size()) == 0 && (*p)[name.size()] == '=' )
+	    return *p + name.size() + 1;
+    return nullptr;
+}
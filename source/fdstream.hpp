@@ -3,6 +3,12 @@
 // - do not support seek and tell operations.
 // - have an additional constructor that takes an already open file descriptor.
 // - provide fd() member function which returns underlying fd associated with open file.
+// - are movable (and so can be elements of containers).
+// - have the size of buffer configurable (and bufsize of 0 for no buffering).
+//
+// basic_fdbuf is the stream buffer that the fdstreams use. It does no codecvt 
+// conversion, and reads/writes directly from/to the fd (without copying through the 
+// buffer) if the block given is not smaller than the buffer.
 //
 // Note: When closing ofdstream that is associated with the input stream of other process 
 // over pipe, the input stream will see end-of-file on read(2); and when closing 
@@ -12,38 +18,332 @@
 // Reference:
 // - fstream
 // - mozjs-60/mozilla/FStream.h
+// - libstdc++: ext/stdio_filebuf.h
 
 
 
 #pragma once
 
-//#include <string>  // char_traits<>
-#include <fstream>  // basic_filebuf<>, basic_fstream<>, .rdbuf(), .is_open(), .close()
-// <cstdio>: BUFSIZ
-#include <string>  // string
-// <memory>: unique_ptr<>, .get(), .reset()
+#include <streambuf>  // basic_streambuf<>
+#include <istream>  // basic_istream<>
+#include <ostream>  // basic_ostream<>
+#include <fstream>  // basic_filebuf<>, basic_fstream<>, ...
+#include <string>  // string, char_traits<>
+#include <memory>  // unique_ptr<>
+#include <algorithm>  // min(), copy_n()
+#include <cstdio>  // BUFSIZ
+#include <cerrno>  // errno, EINTR
 
-#if __GLIBCXX__ >= 20040906  // >= GCC 3.4.2
-# include <ext/stdio_filebuf.h>  // stdio_filebuf<>
-#else
-# error "gcc 3.4.2+ required."
-#endif
+#include "instrument.hpp"  // instrument::_read()
+
+#include <fcntl.h>  // open(), O_RDONLY, O_WRONLY, O_RDWR, O_CREAT, O_TRUNC, ...
+#include <unistd.h>  // read(), close(), lseek()
+#include <sys/uio.h>  // writev(), iovec
+
+
+
+template <typename CharT =char, typename Traits =std::char_traits<CharT>>
+class basic_fdbuf: public std::basic_streambuf<CharT, Traits> {
+public:
+    using int_type = typename Traits::int_type;
+
+private:
+    int _fd = -1;
+    std::ios_base::openmode _mode = std::ios_base::openmode();
+    size_t _bufsize = 0;
+    std::unique_ptr<CharT[]> _gbuf;  // get area
+    std::unique_ptr<CharT[]> _pbuf;  // put area
+    CharT _ch = CharT();  // get area if unbuffered
+
+    void _attach(int fd, std::ios_base::openmode mode, size_t bufsize);
+    void _take(basic_fdbuf& buf);
+    bool _flush();
+    std::streamsize _read(CharT* s, std::streamsize n);
+    bool _write(iovec* iov, int iovcnt);
+
+public:
+    basic_fdbuf() {}
+
+    basic_fdbuf(int fd, std::ios_base::openmode mode,
+	size_t bufsize =static_cast<size_t>(BUFSIZ))
+    { if ( fd >= 0 ) _attach(fd, mode, bufsize); }
+	// The fd will be closed by close() or when destroyed.
+
+    basic_fdbuf(basic_fdbuf&& buf)
+    : std::basic_streambuf<CharT, Traits>(buf)
+    { _take(buf); }
+
+    basic_fdbuf& operator=(basic_fdbuf&& buf) {
+	if ( this != &buf ) {
+	    close();
+	    std::basic_streambuf<CharT, Traits>::operator=(buf);
+	    _take(buf);
+	}
+	return *this;
+    }
+
+    ~basic_fdbuf() { close(); }
+
+    basic_fdbuf* open(const std::string& filename, std::ios_base::openmode mode,
+	size_t bufsize =static_cast<size_t>(BUFSIZ));
+
+    bool is_open() const { return _fd != -1; }
+
+    basic_fdbuf* close();
+
+    int fd() const { return _fd; }
+
+protected:
+    int_type underflow() override;
+    int_type overflow(int_type c =Traits::eof()) override;
+    int sync() override { return _flush() ? 0 : -1; }
+    std::streamsize xsgetn(CharT* s, std::streamsize n) override;
+    std::streamsize xsputn(const CharT* s, std::streamsize n) override;
+};
+
+template <typename CharT, typename Traits>
+void basic_fdbuf<CharT, Traits>::_attach(int fd, std::ios_base::openmode mode,
+    size_t bufsize)
+{
+    _fd = fd;
+    _mode = mode;
+    _bufsize = bufsize;
+
+    if ( mode & std::ios_base::in ) {
+	CharT* p = &_ch;
+	if ( bufsize > 0 ) {
+	    _gbuf.reset(new CharT[bufsize]);
+	    p = _gbuf.get();
+	}
+	this->setg(p, p, p);
+    }
+    if ( mode & std::ios_base::out && bufsize > 0 ) {
+	_pbuf.reset(new CharT[bufsize]);
+	this->setp(_pbuf.get(), _pbuf.get() + bufsize);
+    }
+	// If unbuffered, every character put goes to overflow().
+}
+
+// Take over buf, whose pointers to get/put areas have been copied already.
+template <typename CharT, typename Traits>
+void basic_fdbuf<CharT, Traits>::_take(basic_fdbuf& buf)
+{
+    _fd = buf._fd;
+    _mode = buf._mode;
+    _bufsize = buf._bufsize;
+    _gbuf = std::move(buf._gbuf);
+    _pbuf = std::move(buf._pbuf);
+    _ch = buf._ch;
+    if ( this->eback() == &buf._ch )
+	this->setg(&_ch, &_ch + (this->gptr() - &buf._ch),
+	    &_ch + (this->egptr() - &buf._ch));
+
+    buf._fd = -1;
+    buf.setg(nullptr, nullptr, nullptr);
+    buf.setp(nullptr, nullptr);
+}
+
+template <typename CharT, typename Traits>
+basic_fdbuf<CharT, Traits>* basic_fdbuf<CharT, Traits>::open(const std::string& filename,
+    std::ios_base::openmode mode, size_t bufsize)
+{
+    using std::ios_base;
+
+    if ( is_open() )
+	return nullptr;
+
+    // the same as the table of basic_filebuf::open() in the standard
+    const ios_base::openmode m = mode & ~(ios_base::ate | ios_base::binary);
+    const ios_base::openmode in = ios_base::in, out = ios_base::out;
+    const ios_base::openmode trunc = ios_base::trunc, app = ios_base::app;
+    int flags;
+    if ( m == in )
+	flags = O_RDONLY;
+    else if ( m == out || m == (out | trunc) )
+	flags = O_WRONLY | O_CREAT | O_TRUNC;
+    else if ( m == app || m == (out | app) )
+	flags = O_WRONLY | O_CREAT | O_APPEND;
+    else if ( m == (in | out) )
+	flags = O_RDWR;
+    else if ( m == (in | out | trunc) )
+	flags = O_RDWR | O_CREAT | O_TRUNC;
+    else if ( m == (in | app) || m == (in | out | app) )
+	flags = O_RDWR | O_CREAT | O_APPEND;
+    else
+	return nullptr;
+
+    const int fd = ::open(filename.c_str(), flags | O_CLOEXEC, 0666);
+	// O_CLOEXEC not to be inherited by every process spawned. (It can still be 
+	// passed to a process explicitly as its stdin/stdout/stderr.)
+    if ( fd == -1 )
+	return nullptr;
+    if ( mode & ios_base::ate && ::lseek(fd, 0, SEEK_END) == -1 ) {
+	::close(fd);
+	return nullptr;
+    }
+
+    _attach(fd, mode, bufsize);
+    return this;
+}
+
+template <typename CharT, typename Traits>
+basic_fdbuf<CharT, Traits>* basic_fdbuf<CharT, Traits>::close()
+{
+    if ( !is_open() )
+	return nullptr;
+
+    bool ok = _flush();
+    if ( ::close(_fd) == -1 && errno != EINTR )
+	ok = false;
+    _fd = -1;
+
+    this->setg(nullptr, nullptr, nullptr);
+    this->setp(nullptr, nullptr);
+    _gbuf.reset();
+    _pbuf.reset();
+
+    return ok ? this : nullptr;
+}
+
+// Write out what is in the put area, if any.
+template <typename CharT, typename Traits>
+bool basic_fdbuf<CharT, Traits>::_flush()
+{
+    if ( this->pptr() == this->pbase() )
+	return true;
+
+    iovec iov { this->pbase(), (this->pptr() - this->pbase()) * sizeof(CharT) };
+    const bool ok = _write(&iov, 1);
+    this->setp(this->pbase(), this->epptr());  // discarding what is not written if not ok
+    return ok;
+}
+
+template <typename CharT, typename Traits>
+std::streamsize basic_fdbuf<CharT, Traits>::_read(CharT* s, std::streamsize n)
+{
+    ssize_t k;
+    do k = ::read(_fd, s, n * sizeof(CharT));
+    while ( k == -1 && errno == EINTR );
+    instrument::_read(_fd, k);
+    return k <= 0 ? 0 : k / sizeof(CharT);  // 0 for EOF or error
+}
+
+template <typename CharT, typename Traits>
+bool basic_fdbuf<CharT, Traits>::_write(iovec* iov, int iovcnt)
+{
+    while ( iovcnt > 0 ) {
+	ssize_t k = ::writev(_fd, iov, iovcnt);
+	if ( k == -1 ) {
+	    if ( errno == EINTR )
+		continue;
+	    return false;
+	}
+
+	for ( ; iovcnt > 0 && static_cast<size_t>(k) >= iov->iov_len ; ++iov, --iovcnt )
+	    k -= iov->iov_len;
+	if ( iovcnt > 0 ) {
+	    iov->iov_base = static_cast<char*>(iov->iov_base) + k;
+	    iov->iov_len -= k;
+	}
+    }
+
+    return true;
+}
+
+template <typename CharT, typename Traits>
+typename basic_fdbuf<CharT, Traits>::int_type basic_fdbuf<CharT, Traits>::underflow()
+{
+    if ( this->gptr() < this->egptr() )
+	return Traits::to_int_type(*this->gptr());
+    if ( !is_open() || !(_mode & std::ios_base::in) || !_flush() )
+	return Traits::eof();
+
+    CharT* p = _gbuf ? _gbuf.get() : &_ch;
+    const std::streamsize n = _read(p, _gbuf ? _bufsize : 1);
+    this->setg(p, p, p + n);
+    return n == 0 ? Traits::eof() : Traits::to_int_type(*p);
+}
+
+template <typename CharT, typename Traits>
+typename basic_fdbuf<CharT, Traits>::int_type basic_fdbuf<CharT, Traits>::overflow(int_type c)
+{
+    if ( !is_open() || !(_mode & std::ios_base::out) || !_flush() )
+	return Traits::eof();
+    if ( Traits::eq_int_type(c, Traits::eof()) )
+	return Traits::not_eof(c);
+
+    if ( this->pptr() < this->epptr() ) {
+	*this->pptr() = Traits::to_char_type(c);
+	this->pbump(1);
+    }
+    else {  // unbuffered
+	CharT ch = Traits::to_char_type(c);
+	iovec iov { &ch, sizeof(CharT) };
+	if ( !_write(&iov, 1) )
+	    return Traits::eof();
+    }
+    return c;
+}
+
+template <typename CharT, typename Traits>
+std::streamsize basic_fdbuf<CharT, Traits>::xsgetn(CharT* s, std::streamsize n)
+{
+    // what is in the get area first
+    const std::streamsize avail = std::min<std::streamsize>(n, this->egptr() - this->gptr());
+    std::copy_n(this->gptr(), avail, s);
+    this->setg(this->eback(), this->gptr() + avail, this->egptr());
+
+    std::streamsize got = avail;
+    if ( got == n )
+	return got;
+    if ( static_cast<size_t>(n - got) < _bufsize )
+	return got + std::basic_streambuf<CharT, Traits>::xsgetn(s + got, n - got);
+	// through the get area
+
+    // directly into s if bigger than the buffer
+    if ( !is_open() || !(_mode & std::ios_base::in) || !_flush() )
+	return got;
+    while ( got < n ) {
+	const std::streamsize k = _read(s + got, n - got);
+	if ( k == 0 )
+	    break;
+	got += k;
+    }
+    return got;
+}
+
+template <typename CharT, typename Traits>
+std::streamsize basic_fdbuf<CharT, Traits>::xsputn(const CharT* s, std::streamsize n)
+{
+    if ( n <= this->epptr() - this->pptr() || static_cast<size_t>(n) < _bufsize )
+	return std::basic_streambuf<CharT, Traits>::xsputn(s, n);  // through the put area
+
+    // directly from s (with what is in the put area) if bigger than the buffer
+    if ( !is_open() || !(_mode & std::ios_base::out) )
+	return 0;
+    iovec iov[2] = {
+	{ this->pbase(), (this->pptr() - this->pbase()) * sizeof(CharT) },
+	{ const_cast<CharT*>(s), n * sizeof(CharT) }
+    };
+    const bool ok = _write(iov, 2);
+    this->setp(this->pbase(), this->epptr());
+    return ok ? n : 0;
+}
 
 
 
 template <typename CharT =char, typename Traits =std::char_traits<CharT>>
 class ofdstream: public std::basic_ostream<CharT, Traits> {
 private:
-    std::unique_ptr<std::basic_filebuf<CharT, Traits>> filebuf;
+    basic_fdbuf<CharT, Traits> filebuf;
 
 public:
-    ofdstream() {}  // to open later
+    ofdstream(): std::basic_ostream<CharT, Traits>(nullptr) {}  // to open later
 
     ofdstream(int fd, size_t bufsize =static_cast<size_t>(BUFSIZ))
-    : filebuf { fd < 0 ? nullptr :
-	new __gnu_cxx::stdio_filebuf<CharT, Traits>(fd, std::ios_base::out, bufsize) }
-    // Note: __gnu_cxx::stdio_filebuf<> -> std::basic_filebuf<> -> std::basic_streambuf<>
-    { this->init(filebuf.get()); }
+    : std::basic_ostream<CharT, Traits>(nullptr),
+      filebuf { fd, std::ios_base::out, bufsize }
+    { this->init(fd < 0 ? nullptr : &filebuf); }
 	// this->init(p) is the same as std::basic_ostream<CharT, Traits>::rdbuf(p).
 
     // bufsize of 0 (or setting std::unitbuf (https://stackoverflow.com/a/26976747)) is 
@@ -53,47 +353,56 @@ public:
     // (https://stackoverflow.com/a/42431124).)
 
     ofdstream(const std::string& filename,
-	std::ios_base::openmode mode =std::ios_base::out)
-    { open(filename, mode); }
+	std::ios_base::openmode mode =std::ios_base::out,
+	size_t bufsize =static_cast<size_t>(BUFSIZ))
+    : std::basic_ostream<CharT, Traits>(nullptr)
+    { open(filename, mode, bufsize); }
+
+    ofdstream(ofdstream&& os)
+    : std::basic_ostream<CharT, Traits>(std::move(os)), filebuf { std::move(os.filebuf) }
+    { this->set_rdbuf(os.std::basic_ios<CharT, Traits>::rdbuf() ? &filebuf : nullptr); }
+
+    ofdstream& operator=(ofdstream&& os) {
+	std::basic_ostream<CharT, Traits>::operator=(std::move(os));  // swapping states
+	filebuf = std::move(os.filebuf);
+	this->set_rdbuf(os.std::basic_ios<CharT, Traits>::rdbuf() ? &filebuf : nullptr);
+	return *this;
+    }
 
     ~ofdstream() {}  // will close the underlying fd as well
 
-    // Todo: move constructor/operator!
-
     void open(const std::string& filename,
-	std::ios_base::openmode mode =std::ios_base::out);
+	std::ios_base::openmode mode =std::ios_base::out,
+	size_t bufsize =static_cast<size_t>(BUFSIZ));
 
-    bool is_open() const { return filebuf && filebuf->is_open(); }
+    bool is_open() const { return filebuf.is_open(); }
 
     void close() {  // close the underlying fd like ofstream does
 	// No need to run this->setstate(std::ios_base::eofbit) since closing does not 
 	// mean EOF reached.
-	if ( filebuf && !filebuf->close() )
+	if ( filebuf.is_open() && !filebuf.close() )
 	    this->setstate(std::ios_base::failbit);
     }
 
-    std::basic_filebuf<CharT, Traits>* rdbuf() const { return filebuf.get(); }
+    basic_fdbuf<CharT, Traits>* rdbuf() const
+    { return const_cast<basic_fdbuf<CharT, Traits>*>(&filebuf); }
 
-    int fd() {
-	struct _filebuf: std::basic_filebuf<CharT, Traits> {
-	    int fd() { return this->_M_file.fd(); } };
-	return filebuf ? static_cast<_filebuf*>(filebuf.get())->fd() : -1;
-    }
+    int fd() const { return filebuf.fd(); }
 };
 
 template <typename CharT, typename Traits>
 void ofdstream<CharT, Traits>::open(const std::string& filename,
-    std::ios_base::openmode mode)
+    std::ios_base::openmode mode, size_t bufsize)
 {
-    filebuf.reset(new std::basic_filebuf<CharT, Traits>());
-	// The size of the underlying file buffer is BUFSIZ fixed.
-    if ( filebuf->open(filename, mode | std::ios_base::out) )
+    filebuf.close();
+    if ( filebuf.open(filename, mode | std::ios_base::out, bufsize) ) {
 	this->clear();
+	this->init(&filebuf);
+    }
     else {
-	filebuf.reset();
 	this->setstate(std::ios_base::failbit);
+	this->init(nullptr);
     }
-    this->init(filebuf.get());
 }
 
 
@@ -101,62 +410,75 @@ void ofdstream<CharT, Traits>::open(const std::string& filename,
 template <typename CharT =char, typename Traits =std::char_traits<CharT>>
 class ifdstream: public std::basic_istream<CharT, Traits> {
 private:
-    std::unique_ptr<std::basic_filebuf<CharT, Traits>> filebuf;
+    basic_fdbuf<CharT, Traits> filebuf;
 
 public:
-    ifdstream() {}
+    ifdstream(): std::basic_istream<CharT, Traits>(nullptr) {}
 
     ifdstream(int fd, size_t bufsize =static_cast<size_t>(BUFSIZ))
-    : filebuf { fd < 0 ? nullptr :
-	new __gnu_cxx::stdio_filebuf<CharT, Traits>(fd, std::ios_base::in, bufsize) }
-    { this->init(filebuf.get()); }
+    : std::basic_istream<CharT, Traits>(nullptr),
+      filebuf { fd, std::ios_base::in, bufsize }
+    { this->init(fd < 0 ? nullptr : &filebuf); }
 
     // bufsize of 0 is preferred for pipes, assuming that accessing pipe is efficient 
     // enough that we don't need another layer of buffering.
 
     ifdstream(const std::string& filename,
-	std::ios_base::openmode mode =std::ios_base::in)
-    { open(filename, mode); }
+	std::ios_base::openmode mode =std::ios_base::in,
+	size_t bufsize =static_cast<size_t>(BUFSIZ))
+    : std::basic_istream<CharT, Traits>(nullptr)
+    { open(filename, mode, bufsize); }
+
+    ifdstream(ifdstream&& is)
+    : std::basic_istream<CharT, Traits>(std::move(is)), filebuf { std::move(is.filebuf) }
+    { this->set_rdbuf(is.std::basic_ios<CharT, Traits>::rdbuf() ? &filebuf : nullptr); }
+
+    ifdstream& operator=(ifdstream&& is) {
+	std::basic_istream<CharT, Traits>::operator=(std::move(is));
+	filebuf = std::move(is.filebuf);
+	this->set_rdbuf(is.std::basic_ios<CharT, Traits>::rdbuf() ? &filebuf : nullptr);
+	return *this;
+    }
 
     ~ifdstream() {}
 
     void open(const std::string& filename,
-	std::ios_base::openmode mode =std::ios_base::in);
+	std::ios_base::openmode mode =std::ios_base::in,
+	size_t bufsize =static_cast<size_t>(BUFSIZ));
 
-    bool is_open() const { return filebuf && filebuf->is_open(); }
+    bool is_open() const { return filebuf.is_open(); }
 
     void close() {
-	if ( filebuf && !filebuf->close() )
+	if ( filebuf.is_open() && !filebuf.close() )
 	    this->setstate(std::ios_base::failbit);
     }
 
-    std::basic_filebuf<CharT, Traits>* rdbuf() const { return filebuf.get(); }
+    basic_fdbuf<CharT, Traits>* rdbuf() const
+    { return const_cast<basic_fdbuf<CharT, Traits>*>(&filebuf); }
 
-    int fd() {
-	struct _filebuf: std::basic_filebuf<CharT, Traits> {
-	    int fd() { return this->_M_file.fd(); } };
-	return filebuf ? static_cast<_filebuf*>(filebuf.get())->fd() : -1;
-    }
+    int fd() const { return filebuf.fd(); }
 };
 
 template <typename CharT, typename Traits>
 void ifdstream<CharT, Traits>::open(const std::string& filename,
-    std::ios_base::openmode mode)
+    std::ios_base::openmode mode, size_t bufsize)
 {
-    filebuf.reset(new std::basic_filebuf<CharT, Traits>());
-    if ( filebuf->open(filename, mode | std::ios_base::in) )
+    filebuf.close();
+    if ( filebuf.open(filename, mode | std::ios_base::in, bufsize) ) {
 	this->clear();
+	this->init(&filebuf);
+    }
     else {
-	filebuf.reset();
 	this->setstate(std::ios_base::failbit);
+	this->init(nullptr);
     }
-    this->init(filebuf.get());
 }
 
 
 
-// Return fd that is associated with an open fstream/ofstream/ifstream.
+// Return fd that is associated with an open fstream/ofstream/ifstream. (libstdc++ only)
 
+#if __GLIBCXX__ >= 20040906  // >= GCC 3.4.2
 template<typename CharT, typename Traits>
 inline int fd(std::basic_fstream<CharT, Traits>& file)
 {
@@ -180,3 +502,4 @@ inline int fd(std::basic_ifstream<CharT, Traits>& file)
         int fd() { return this->_M_file.fd(); } };
     return static_cast<_filebuf*>(file.rdbuf())->fd();
 }
+#endif
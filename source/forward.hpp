@@ -0,0 +1,403 @@
+// forward(): zero-copy forwarding of data from one fd to another
+//
+// - forward(src, dst) forwards all data from src to dst until EOF on src, and returns the 
+//   number of bytes forwarded. (forward(src, dst, count) forwards count bytes at most.)
+// - forward_async(src, dst) does the same in a separate thread, returning a future<> of 
+//   the number of bytes forwarded.
+// - fanout(src, { dst1, dst2, ... }) forwards all data from src (which should be a pipe, 
+//   e.g, proc.stdout) to all of dst1, dst2, ... (e.g, proc1.stdin, proc2.stdin, or a 
+//   file) until EOF on src, and returns the number of bytes read from src. fanout_async() 
+//   does the same in a separate thread.
+// - All of them throw system_error on error. Note forwarding into a pipe (or socket) 
+//   whose reading end has been closed raises SIGPIPE, just like writing into it does. 
+//   (If SIGPIPE is ignored or blocked, fanout() just stops forwarding to that one, and 
+//   continues to forward to the others.)
+//
+// Depending on the type of src and dst, forward() chooses the fastest way that does not 
+// copy data to and from user space:
+// - splice() if src or dst is a pipe (e.g, proc.stdout or proc.stdin),
+// - copy_file_range() if src and dst are both regular files,
+// - sendfile() if src is a regular file,
+// - splice() through an intermediate pipe otherwise (e.g, from socket to socket), 
+// and falls back to read() and write() if system does not support the way chosen.
+//
+// fanout() duplicates data in src to each destination (but the last one) using tee() 
+// into a private pipe, and then moves data in src to the last destination using splice() 
+// (and data in each private pipe to its destination as well). Data are not copied into 
+// user space (unless a destination does not support splice(), e.g, a file opened with 
+// O_APPEND, for which they are copied by read() and write() as in forward()), and 
+// fanout() reads from src only as fast as the slowest destination can take, so that no 
+// more data are buffered than in the pipes.
+
+// Reference:
+// - splice(2), tee(2), copy_file_range(2), sendfile(2)
+
+
+
+#pragma once
+
+#include <algorithm>  // min()
+#include <cstdint>  // SIZE_MAX
+#include <future>  // future<>, async()
+#include <vector>  // vector<>
+#include <system_error>  // system_error(), system_category(), errno
+
+extern "C" {
+#include <fcntl.h>  // splice(), tee(), SPLICE_F_MOVE, SPLICE_F_MORE, F_GETPIPE_SZ, ...
+#include <poll.h>  // poll(), POLLIN, POLLOUT
+#include <sys/sendfile.h>  // sendfile()
+#include <sys/stat.h>  // fstat(), S_ISFIFO(), S_ISREG()
+#include <unistd.h>  // copy_file_range(), read(), write(), pipe2(), close()
+}
+
+
+
+namespace _forward {
+
+constexpr size_t CHUNK = 1024 * 1024;  // bytes to move at a time
+
+// wait until src is readable and dst is writable, for non-blocking fds (either of which 
+// can be -1 not to wait for). We wait for one and then the other, since waiting for 
+// either would return at once while the other is not ready, and spin.
+inline void _wait(int src, int dst)
+{
+    struct pollfd pfds[2] = { { src, POLLIN, 0 }, { dst, POLLOUT, 0 } };
+    for ( auto& pfd: pfds )
+	if ( pfd.fd != -1 )
+	    ::poll(&pfd, 1, -1);
+}
+
+// forward using the given function f(size) that returns the result of system call, or 
+// returning -1 with errno = EINVAL if f() is not supported (when nothing is forwarded 
+// yet).
+template <typename F>
+ssize_t _using(int src, int dst, size_t count, size_t& total, F&& f)
+{
+    while ( total < count ) {
+	const ssize_t n = f(std::min(count - total, CHUNK));
+	if ( n > 0 )
+	    total += n;
+	else if ( n == 0 )
+	    break;  // EOF
+	else if ( errno == EAGAIN )
+	    _wait(src, dst);
+	else if ( errno != EINTR ) {
+	    if ( total == 0 && (errno == EINVAL || errno == ENOSYS || errno == EXDEV
+		|| errno == EOPNOTSUPP) )
+		return -1;  // not supported
+	    throw std::system_error(errno, std::system_category());
+	}
+    }
+
+    return 0;
+}
+
+// write exactly n bytes from buf to dst, returning false if dst has been closed.
+inline bool _write_all(int dst, const char* buf, size_t n)
+{
+    while ( n > 0 ) {
+	const ssize_t k = ::write(dst, buf, n);
+	if ( k > 0 ) {
+	    buf += k;
+	    n -= k;
+	}
+	else if ( errno == EAGAIN )
+	    _wait(-1, dst);
+	else if ( errno == EPIPE )
+	    return false;
+	else if ( errno != EINTR )
+	    throw std::system_error(errno, std::system_category());
+    }
+
+    return true;
+}
+
+// read exactly n bytes from src, throwing system_error (of EIO if EOF) if failed.
+inline void _read_all(int src, char* buf, size_t n)
+{
+    for ( size_t got = 0 ; got < n ; ) {
+	const ssize_t k = ::read(src, buf + got, n - got);
+	if ( k > 0 )
+	    got += k;
+	else if ( k == -1 && errno == EAGAIN )
+	    _wait(src, -1);
+	else if ( k == 0 || errno != EINTR )
+	    throw std::system_error(k == 0 ? EIO : errno, std::system_category());
+    }
+}
+
+// move n bytes from pipe src to dst, returning how many bytes are left in src if dst has 
+// been closed (by EPIPE), or 0. If dst does not support splice() (e.g, a file opened 
+// with O_APPEND), they are copied by read() and write() instead, as in forward().
+inline size_t _splice_all(int src, int dst, size_t n)
+{
+    while ( n > 0 ) {
+	const ssize_t k = ::splice(src, nullptr, dst, nullptr, n,
+	    SPLICE_F_MOVE | SPLICE_F_MORE);
+	if ( k > 0 )
+	    n -= k;
+	else if ( k == -1 && errno == EAGAIN )
+	    _wait(src, dst);
+	else if ( k == -1 && errno == EPIPE )
+	    return n;
+	else if ( k == -1 && (errno == EINVAL || errno == EOPNOTSUPP) ) {
+	    char buf[64 * 1024];
+	    for ( size_t m ; n > 0 ; n -= m ) {
+		m = std::min(n, sizeof(buf));
+		_read_all(src, buf, m);
+		if ( !_write_all(dst, buf, m) )
+		    return n - m;
+	    }
+	}
+	else if ( k == -1 && errno != EINTR )
+	    throw std::system_error(errno, std::system_category());
+	else if ( k == 0 )
+	    throw std::system_error(EIO, std::system_category());  // cannot happen
+    }
+
+    return 0;
+}
+
+} // namespace _forward
+
+inline size_t forward(int src, int dst, size_t count =SIZE_MAX)
+{
+    using namespace _forward;
+
+    struct stat st_src, st_dst;
+    if ( ::fstat(src, &st_src) == -1 || ::fstat(dst, &st_dst) == -1 )
+	throw std::system_error(errno, std::system_category());
+
+    size_t total = 0;
+
+    if ( S_ISFIFO(st_src.st_mode) || S_ISFIFO(st_dst.st_mode) ) {
+	if ( _using(src, dst, count, total, [=](size_t n){
+	    return ::splice(src, nullptr, dst, nullptr, n, SPLICE_F_MOVE | SPLICE_F_MORE);
+	}) == 0 )
+	    return total;
+    }
+
+    else if ( S_ISREG(st_src.st_mode) ) {
+	if ( S_ISREG(st_dst.st_mode) && _using(src, dst, count, total, [=](size_t n){
+	    return ::copy_file_range(src, nullptr, dst, nullptr, n, 0);
+	}) == 0 )
+	    return total;
+
+	if ( _using(src, dst, count, total, [=](size_t n){
+	    return ::sendfile(dst, src, nullptr, n);
+	}) == 0 )
+	    return total;
+    }
+
+    else {
+	int fds[2];
+	if ( ::pipe2(fds, O_CLOEXEC) == 0 ) {
+	    ssize_t result;
+	    try {
+		result = _using(src, dst, count, total, [&](size_t n){
+		    const ssize_t k = ::splice(src, nullptr, fds[1], nullptr, n,
+			SPLICE_F_MOVE | SPLICE_F_MORE);
+		    for ( ssize_t left = k ; left > 0 ; ) {
+			const ssize_t m = ::splice(fds[0], nullptr, dst, nullptr, left,
+			    SPLICE_F_MOVE | SPLICE_F_MORE);
+			if ( m == -1 && errno == EAGAIN )
+			    _wait(fds[0], dst);
+			else if ( m == -1 && errno != EINTR )
+			    throw std::system_error(errno, std::system_category());
+			    // cannot fall back since data is half-way in the pipe.
+			else if ( m > 0 )
+			    left -= m;
+		    }
+		    return k;
+		});
+	    }
+	    catch ( ... ) {
+		::close(fds[0]);
+		::close(fds[1]);
+		throw;
+	    }
+	    ::close(fds[0]);
+	    ::close(fds[1]);
+	    if ( result == 0 )
+		return total;
+	}
+    }
+
+    // fall back to read() and write()
+    char buf[64 * 1024];
+    while ( total < count ) {
+	const ssize_t n = ::read(src, buf, std::min(count - total, sizeof(buf)));
+	if ( n == 0 )
+	    break;
+	if ( n == -1 ) {
+	    if ( errno == EAGAIN )
+		_wait(src, -1);
+	    else if ( errno != EINTR )
+		throw std::system_error(errno, std::system_category());
+	    continue;
+	}
+
+	for ( ssize_t written = 0 ; written < n ; ) {
+	    const ssize_t k = ::write(dst, buf + written, n - written);
+	    if ( k > 0 )
+		written += k;
+	    else if ( errno == EAGAIN )
+		_wait(-1, dst);
+	    else if ( errno != EINTR )
+		throw std::system_error(errno, std::system_category());
+	}
+	total += n;
+    }
+
+    return total;
+}
+
+inline std::future<size_t> forward_async(int src, int dst, size_t count =SIZE_MAX)
+{
+    return std::async(std::launch::async, forward, src, dst, count);
+}
+
+inline size_t fanout(int src, const std::vector<int>& dsts)
+{
+    using namespace _forward;
+
+    if ( dsts.empty() )
+	throw std::system_error(EINVAL, std::system_category());
+    if ( dsts.size() == 1 )
+	return forward(src, dsts[0]);
+
+    const int capacity = ::fcntl(src, F_GETPIPE_SZ);
+    if ( capacity == -1 )  // src is not a pipe.
+	throw std::system_error(errno == EBADF ? EBADF : EINVAL, std::system_category());
+
+    // Each destination but the last has a private pipe as big as src, so that tee() of 
+    // what is in src into it (while empty) will duplicate all of that at once.
+    struct _mid { int dst; int fds[2]; };
+    std::vector<_mid> mids;
+    const auto close_mid = [](_mid& mid){ ::close(mid.fds[0]); ::close(mid.fds[1]); };
+    int last = dsts.back();
+
+    size_t total = 0;
+    try {
+	for ( size_t i = 0 ; i + 1 < dsts.size() ; ++i ) {
+	    mids.push_back({ dsts[i], { -1, -1 } });
+	    if ( ::pipe2(mids.back().fds, O_CLOEXEC) == -1 )
+		throw std::system_error(errno, std::system_category());
+	    ::fcntl(mids.back().fds[1], F_SETPIPE_SZ, capacity);
+	}
+
+	std::vector<char> buf;  // used only if there is no way but to copy.
+	const auto read_all = [&](int fd, size_t n) {
+	    buf.resize(n);
+	    _read_all(fd, buf.data(), n);
+	};
+
+	bool copying = false;  // if tee() is not supported
+	for ( bool eof = false ; !eof && !mids.empty() ; ) {
+	    // Duplicate what is in src into the first private pipe, which decides how 
+	    // much we forward in this round. (tee() waits until some data are available.)
+	    ssize_t n = ::tee(src, mids[0].fds[1], capacity, 0);
+	    if ( n == -1 && errno == EAGAIN )
+		_wait(src, -1);
+	    else if ( n == -1 && errno == EINVAL ) {
+		copying = true;
+		break;
+	    }
+	    else if ( n == -1 && errno != EINTR )
+		throw std::system_error(errno, std::system_category());
+	    eof = n == 0;
+	    if ( n <= 0 )
+		continue;
+
+	    // Then the same n bytes into the other private pipes.
+	    std::vector<ssize_t> teed(mids.size(), n);
+	    bool short_teed = false;
+	    for ( size_t i = 1 ; i < mids.size() ; ++i ) {
+		do teed[i] = ::tee(src, mids[i].fds[1], n, 0);
+		while ( teed[i] == -1 && errno == EINTR );
+		if ( teed[i] == -1 && errno == EINVAL )
+		    teed[i] = 0;  // to be copied below
+		else if ( teed[i] == -1 )
+		    throw std::system_error(errno, std::system_category());
+		short_teed |= teed[i] < n;
+	    }
+
+	    // Take n bytes out of src into the last destination. (If tee() duplicated 
+	    // less than expected, which should not happen, we make up for it by copy.)
+	    if ( short_teed || last == -1 ) {
+		read_all(src, n);
+		for ( size_t i = 1 ; i < mids.size() ; ++i )
+		    _write_all(mids[i].fds[1], buf.data() + teed[i], n - teed[i]);
+		if ( last != -1 && !_write_all(last, buf.data(), n) )
+		    last = -1;
+	    }
+	    else if ( const size_t left = _splice_all(src, last, n) ) {
+		last = -1;
+		read_all(src, left);
+	    }
+
+	    // Finally, move each private pipe to its destination, which makes us wait 
+	    // for the slowest one. If one has been closed, we forget it.
+	    for ( size_t i = 0 ; i < mids.size() ; )
+		if ( _splice_all(mids[i].fds[0], mids[i].dst, n) == 0 )
+		    ++i;
+		else {
+		    close_mid(mids[i]);
+		    mids.erase(mids.begin() + i);
+		}
+
+	    total += n;
+	}
+
+	// Without tee(), we copy what is in src to each destination by read() and write() 
+	// from now on, as forward() falls back to, until EOF or all have been closed.
+	if ( copying ) {
+	    std::vector<int> outs;
+	    for ( const _mid& mid: mids )
+		outs.push_back(mid.dst);
+	    if ( last != -1 )
+		outs.push_back(last);
+	    buf.resize(64 * 1024);
+	    while ( !outs.empty() ) {
+		const ssize_t n = ::read(src, buf.data(), buf.size());
+		if ( n == 0 )
+		    break;
+		if ( n == -1 ) {
+		    if ( errno == EAGAIN )
+			_wait(src, -1);
+		    else if ( errno != EINTR )
+			throw std::system_error(errno, std::system_category());
+		    continue;
+		}
+		for ( size_t i = 0 ; i < outs.size() ; )
+		    if ( _write_all(outs[i], buf.data(), n) )
+			++i;
+		    else
+			outs.erase(outs.begin() + i);
+		total += n;
+	    }
+	    last = -1;
+	}
+
+	// Unless EOF, all but the last destination have been closed.
+	if ( !mids.empty() )
+	    last = -1;
+	if ( last != -1 )
+	    total += forward(src, last);
+    }
+    catch ( ... ) {
+	for ( _mid& mid: mids )
+	    close_mid(mid);
+	throw;
+    }
+
+    for ( _mid& mid: mids )
+	close_mid(mid);
+    return total;
+}
+
+inline std::future<size_t> fanout_async(int src, std::vector<int> dsts)
+{
+    return std::async(std::launch::async,
+	[src, dsts = std::move(dsts)]{ return fanout(src, dsts); });
+}
@@ -0,0 +1,210 @@
+// instrument: optional latency histograms for the stages of child processes
+//
+// Compiled with -DPROCESS_INSTRUMENT, each process records how long it has taken from 
+// the start of spawning until each of the stages below, into a lock-free histogram for 
+// the stage:
+// - instrument::SPAWN: fork() (or clone(), or the round trip to zygote) has returned.
+// - instrument::EXEC: child process has exec*()ed successfully.
+// - instrument::FIRST_BYTE: the first byte has been read from its stdout (of PIPE).
+// - instrument::END: EOF has been read from its stdout.
+// - instrument::EXIT: child process has been reaped, by wait(), poll(), reaper, uring, 
+//   ... (which is the same as proc.usage.runtime).
+//
+// So, SPAWN and EXEC growing point to fork() (or exec*() of child), EXIT growing while 
+// CPU times of proc.usage do not points to waiting (e.g, the backoff of wait(timeout)), 
+// and FIRST_BYTE and END to pipe stalls. Reading stdout is noticed if read by 
+// process::read_all(), communicate(), lines, fdstreams, or uring.
+//
+// - instrument::of(stage) returns the histogram of the stage, with buckets of 1us, 2us, 
+//   4us, ... up to 2^31us (about 36min) and +Inf.
+// - instrument::sink(cb) has cb(stage, elapsed) called for each record as well.
+// - instrument::dump(s) appends all histograms to s in the Prometheus text format.
+//
+// Without PROCESS_INSTRUMENT, the hooks are all empty inline functions, which cost 
+// nothing, and the histograms stay empty.
+
+
+
+#pragma once
+
+#include <atomic>  // atomic<>
+#include <chrono>  // chrono::steady_clock, chrono::nanoseconds, chrono::duration<>
+#include <cstdint>  // uint64_t, int64_t
+#include <cstdio>  // snprintf()
+#include <string>  // string, .append()
+
+extern "C" {
+#include <sys/types.h>  // ssize_t
+}
+
+
+
+template <typename CharT, typename Traits> class basic_fdbuf;  // in fdstream.hpp
+
+class instrument {
+    friend class process_handle;
+    friend class process;
+    friend class pipeline;
+    friend class lines;
+    friend class uring;
+    template <typename CharT, typename Traits> friend class basic_fdbuf;
+
+public:
+    enum stage { SPAWN, EXEC, FIRST_BYTE, END, EXIT, STAGES };
+
+    class histogram {
+    public:
+	static constexpr int BUCKETS = 32;  // of 2^i us (0 <= i < BUCKETS), besides +Inf
+
+	// add d into the bucket of the smallest bound that is not less than d.
+	void add(std::chrono::nanoseconds d);
+
+	uint64_t count() const { return _count.load(std::memory_order_relaxed); }
+	std::chrono::nanoseconds sum() const
+	{ return std::chrono::nanoseconds(_sum.load(std::memory_order_relaxed)); }
+
+	// number of records in bucket i (not cumulative), where i == BUCKETS for +Inf
+	uint64_t bucket(int i) const { return _buckets[i].load(std::memory_order_relaxed); }
+
+	// upper bound of bucket i (i < BUCKETS)
+	static std::chrono::nanoseconds bound(int i)
+	{ return std::chrono::nanoseconds(1000LL << i); }
+
+    private:
+	std::atomic<uint64_t> _buckets[BUCKETS + 1] {};
+	std::atomic<uint64_t> _count { 0 };
+	std::atomic<int64_t> _sum { 0 };  // in nanoseconds
+    };
+
+    static const histogram& of(stage s) { return _histograms[s]; }
+
+    using sink_t = void (*)(stage s, std::chrono::nanoseconds elapsed);
+
+    // have cb called for each record from now on, or stop calling if cb == nullptr. (cb 
+    // is called right in the thread recording, which should not be blocked for long.)
+    static void sink(sink_t cb) { _sink.store(cb, std::memory_order_release); }
+
+    // append histograms to s in the Prometheus text format, as process_<stage>_seconds.
+    static void dump(std::string& s);
+
+private:
+    static histogram _histograms[STAGES];  // defined below, as histogram is complete
+    static inline std::atomic<sink_t> _sink { nullptr };
+
+    using time_point = std::chrono::steady_clock::time_point;
+
+#ifdef PROCESS_INSTRUMENT
+    // record the time elapsed since spawned for stage s.
+    static void _record(stage s, time_point spawned);
+
+    // watch fd for reads of FIRST_BYTE and END of the process spawned at spawned, or 
+    // stop watching it.
+    static void _watch(int fd, time_point spawned);
+    static void _unwatch(int fd);
+
+    // notice the result n of ::read() from fd.
+    static void _read(int fd, ssize_t n);
+
+    // spawned (in nanoseconds of steady_clock) of the process that each fd is stdout of, 
+    // negated once FIRST_BYTE is recorded, or 0 if not watched (nor for fds >= WATCHED)
+    enum { WATCHED = 1024 };
+    static inline std::atomic<int64_t> _watched[WATCHED] {};
+#else
+    static void _record(stage, time_point) {}
+    static void _watch(int, time_point) {}
+    static void _unwatch(int) {}
+    static void _read(int, ssize_t) {}
+#endif
+};
+
+inline instrument::histogram instrument::_histograms[STAGES];
+
+void instrument::histogram::add(std::chrono::nanoseconds d)
+{
+    // bucket i holds (2^(i-1) us, 2^i us], with us rounded up.
+    const uint64_t us = d.count() <= 0 ? 0 : (d.count() + 999) / 1000;
+    const int i = us <= 1 ? 0 : 64 - __builtin_clzll(us - 1);
+
+    _buckets[i < BUCKETS ? i : BUCKETS].fetch_add(1, std::memory_order_relaxed);
+    _sum.fetch_add(d.count(), std::memory_order_relaxed);
+    _count.fetch_add(1, std::memory_order_relaxed);
+}
+
+void instrument::dump(std::string& s)
+{
+    static const char* const names[STAGES] = {
+	"spawn", "exec", "first_byte", "end", "exit" };
+    static const char* const helps[STAGES] = {
+	"fork() (or clone()) returned", "child process exec*()ed",
+	"first byte read from stdout", "EOF read from stdout", "child process reaped" };
+
+    char line[128];
+    for ( int st = 0 ; st < STAGES ; ++st ) {
+	const histogram& h = _histograms[st];
+	snprintf(line, sizeof(line), "# HELP process_%s_seconds Time until %s since spawn\n",
+	    names[st], helps[st]);
+	s.append(line);
+	snprintf(line, sizeof(line), "# TYPE process_%s_seconds histogram\n", names[st]);
+	s.append(line);
+
+	uint64_t cumulative = 0;
+	for ( int i = 0 ; i < histogram::BUCKETS ; ++i ) {
+	    cumulative += h.bucket(i);
+	    snprintf(line, sizeof(line), "process_%s_seconds_bucket{le=\"%g\"} %llu\n",
+		names[st], histogram::bound(i).count() / 1e9,
+		static_cast<unsigned long long>(cumulative));
+	    s.append(line);
+	}
+	cumulative += h.bucket(histogram::BUCKETS);
+	snprintf(line, sizeof(line), "process_%s_seconds_bucket{le=\"+Inf\"} %llu\n",
+	    names[st], static_cast<unsigned long long>(cumulative));
+	s.append(line);
+	snprintf(line, sizeof(line), "process_%s_seconds_sum %.9f\n", names[st],
+	    h.sum().count() / 1e9);
+	s.append(line);
+	snprintf(line, sizeof(line), "process_%s_seconds_count %llu\n", names[st],
+	    static_cast<unsigned long long>(cumulative));
+	s.append(line);
+    }
+}
+
+#ifdef PROCESS_INSTRUMENT
+
+void instrument::_record(stage s, time_point spawned)
+{
+    const auto elapsed = std::chrono::steady_clock::now() - spawned;
+    _histograms[s].add(elapsed);
+    if ( const sink_t cb = _sink.load(std::memory_order_acquire) )
+	cb(s, elapsed);
+}
+
+void instrument::_watch(int fd, time_point spawned)
+{
+    if ( fd >= 0 && fd < WATCHED )
+	_watched[fd].store(std::chrono::nanoseconds(spawned.time_since_epoch()).count(),
+	    std::memory_order_relaxed);
+}
+
+void instrument::_unwatch(int fd)
+{
+    if ( fd >= 0 && fd < WATCHED )
+	_watched[fd].store(0, std::memory_order_relaxed);
+}
+
+void instrument::_read(int fd, ssize_t n)
+{
+    if ( fd < 0 || fd >= WATCHED || n < 0 )
+	return;
+
+    // Only the first of the threads reading fd at the same time records each stage.
+    int64_t t = _watched[fd].load(std::memory_order_relaxed);
+    if ( n > 0 ) {
+	if ( t > 0 && _watched[fd].compare_exchange_strong(t, -t,
+	    std::memory_order_relaxed) )
+	    _record(FIRST_BYTE, time_point(std::chrono::nanoseconds(t)));
+    }
+    else if ( t != 0 && (t = _watched[fd].exchange(0, std::memory_order_relaxed)) != 0 )
+	_record(END, time_point(std::chrono::nanoseconds(t < 0 ? -t : t)));
+}
+
+#endif  // PROCESS_INSTRUMENT
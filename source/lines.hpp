@@ -0,0 +1,134 @@
+// lines: a range of lines read from fd, each as string_view without allocation
+//
+// - for ( std::string_view line: lines(proc.stdout) ) ... iterates over the lines read 
+//   from proc.stdout until EOF, each without the delimiter (just like getline()). The 
+//   last line is given even if it does not end with the delimiter, unless empty.
+// - lines(fd, delim) for lines delimited by delim (e.g, '\0' for output of find -print0) 
+//   instead of '\n', and lines(fd, delim, bufsize) for the initial size of the buffer.
+// - Each line is a view into the buffer of lines, valid only until advancing to the next 
+//   line, which is why no line is copied or allocated. (Copy it into std::string if it 
+//   needs to be kept.)
+// - A line longer than the buffer just makes the buffer grow (twice each time).
+// - It throws system_error if read() fails.
+//
+// Delimiters are searched with memchr(), which glibc implements with SSE2/AVX2/EVEX (or 
+// NEON/SVE on ARM) selected at run time, scanning each byte only once even if a line is 
+// split across two reads.
+
+// Reference:
+// - https://sourceware.org/git/?p=glibc.git;a=tree;f=sysdeps/x86_64/multiarch
+
+
+
+#pragma once
+
+#include <cstring>  // memchr(), memmove(), memcpy()
+#include <iterator>  // input_iterator_tag
+#include <memory>  // unique_ptr<>
+#include <string_view>  // string_view
+#include <system_error>  // system_error(), system_category(), errno
+
+#include "instrument.hpp"  // instrument::_read()
+
+#include <poll.h>  // poll(), POLLIN
+#include <unistd.h>  // read()
+
+
+
+class lines {
+private:
+    int _fd;
+    char _delim;
+    size_t _bufsize;
+    std::unique_ptr<char[]> _buf;
+    size_t _begin = 0;  // of line next
+    size_t _scanned = 0;  // up to where no delimiter found
+    size_t _end = 0;  // of data read
+    bool _eof = false;
+
+    bool _next(std::string_view& line);
+
+public:
+    class iterator {
+    private:
+	lines* _lines = nullptr;  // nullptr for end
+	std::string_view _line;
+
+    public:
+	using iterator_category = std::input_iterator_tag;
+	using value_type = std::string_view;
+	using difference_type = std::ptrdiff_t;
+	using pointer = const std::string_view*;
+	using reference = const std::string_view&;
+
+	iterator() {}
+	iterator(lines* l): _lines(l) { ++*this; }
+
+	reference operator*() const { return _line; }
+	pointer operator->() const { return &_line; }
+
+	iterator& operator++() {
+	    if ( _lines && !_lines->_next(_line) )
+		_lines = nullptr;
+	    return *this;
+	}
+
+	bool operator==(const iterator& it) const { return _lines == it._lines; }
+	bool operator!=(const iterator& it) const { return _lines != it._lines; }
+    };
+
+    explicit lines(int fd, char delim ='\n', size_t bufsize =256 * 1024)
+    : _fd(fd), _delim(delim), _bufsize(bufsize > 0 ? bufsize : 1),
+      _buf(new char[_bufsize]) {}
+
+    // Note begin() does not rewind, but continues from the line next.
+    iterator begin() { return iterator(this); }
+    iterator end() { return iterator(); }
+};
+
+bool lines::_next(std::string_view& line)
+{
+    for ( ;; ) {
+	if ( const void* p = std::memchr(&_buf[_scanned], _delim, _end - _scanned) ) {
+	    const size_t pos = static_cast<const char*>(p) - &_buf[0];
+	    line = std::string_view(&_buf[_begin], pos - _begin);
+	    _begin = _scanned = pos + 1;
+	    return true;
+	}
+	_scanned = _end;
+
+	if ( _eof ) {
+	    if ( _begin == _end )
+		return false;
+	    line = std::string_view(&_buf[_begin], _end - _begin);
+	    _begin = _end;
+	    return true;
+	}
+
+	// Move the partial line to the front, or grow the buffer if it is full of it.
+	if ( _begin > 0 ) {
+	    std::memmove(&_buf[0], &_buf[_begin], _end - _begin);
+	    _scanned = _end -= _begin;
+	    _begin = 0;
+	}
+	else if ( _end == _bufsize ) {
+	    std::unique_ptr<char[]> buf(new char[_bufsize * 2]);
+	    std::memcpy(&buf[0], &_buf[0], _end);
+	    _buf = std::move(buf);
+	    _bufsize *= 2;
+	}
+
+	const ssize_t n = ::read(_fd, &_buf[_end], _bufsize - _end);
+	instrument::_read(_fd, n);
+	if ( n > 0 )
+	    _end += n;
+	else if ( n == 0 )
+	    _eof = true;
+	else if ( errno == EAGAIN ) {  // in case fd is O_NONBLOCK
+	    pollfd fds { _fd, POLLIN, 0 };
+	    ::poll(&fds, 1, -1);
+	}
+	else if ( errno != EINTR )
+	    throw std::system_error(errno, std::system_category());
+    }
+}
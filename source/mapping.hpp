@@ -0,0 +1,78 @@
+// mapping: read-only view of output captured into a file, mapped into memory in place
+//
+// - After process proc { { "pg_dump", "db" }, process::MEMFD }; and proc.wait();, 
+//   mapping m { proc.stdout }; maps what child process has written into its stdout (of 
+//   MEMFD), and m.view() returns it as a string_view, to be parsed without copying it.
+// - m.data() and m.size() return the address and size of the mapping, which is empty 
+//   (with data() == nullptr) if nothing has been written.
+// - mapping is movable but not copyable, and unmaps on destruction. It stays valid after 
+//   the fd (or process) is closed, as the file is alive as long as it is mapped.
+// - mapping m { fd }; works for any regular file (e.g, of capture_dir in options), 
+//   mapping its whole size as of construction, and throws system_error if it cannot be 
+//   mapped (e.g, for a pipe).
+//
+// Child process should be done writing (e.g, after proc.wait()), since the size is taken 
+// at construction and what is written beyond it is not seen through the mapping.
+
+
+
+#pragma once
+
+#include <string_view>  // string_view
+#include <system_error>  // system_error(), system_category(), errno
+#include <utility>  // exchange(), swap()
+
+extern "C" {
+#include <sys/mman.h>  // mmap(), munmap(), madvise(), MADV_SEQUENTIAL
+#include <sys/stat.h>  // fstat()
+}
+
+
+
+class mapping {
+private:
+    const char* _data = nullptr;
+    size_t _size = 0;
+
+public:
+    mapping() {}  // empty mapping
+    explicit mapping(int fd);
+    ~mapping() { if ( _data ) ::munmap(const_cast<char*>(_data), _size); }
+
+    mapping(mapping&& m)
+    : _data { std::exchange(m._data, nullptr) }, _size { std::exchange(m._size, 0) } {}
+    mapping& operator=(mapping&& m) {  // swapping, to unmap ours when m is destroyed
+	std::swap(_data, m._data);
+	std::swap(_size, m._size);
+	return *this;
+    }
+
+    mapping(const mapping&) =delete;
+    mapping& operator=(const mapping&) =delete;
+
+    const char* data() const { return _data; }
+    size_t size() const { return _size; }
+    bool empty() const { return _size == 0; }
+
+    std::string_view view() const { return std::string_view(_data, _size); }
+    operator std::string_view() const { return view(); }
+};
+
+mapping::mapping(int fd)
+{
+    struct stat st;
+    if ( ::fstat(fd, &st) == -1 )
+	throw std::system_error(errno, std::system_category());
+    if ( !S_ISREG(st.st_mode) )
+	throw std::system_error(ENODEV, std::system_category());  // as mmap() would do
+    if ( st.st_size == 0 )
+	return;  // since mmap() of length 0 fails with EINVAL.
+
+    void* const p = ::mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if ( p == MAP_FAILED )
+	throw std::system_error(errno, std::system_category());
+    ::madvise(p, st.st_size, MADV_SEQUENTIAL);  // for readahead from disk (if any)
+
+    _data = static_cast<const char*>(p);
+    _size = st.st_size;
+}
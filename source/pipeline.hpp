@@ -0,0 +1,204 @@
+// pipeline: chain of processes with stdout of each piped into stdin of next one
+//
+// - cmd { "ls", "-l" } describes a command (without running it), and cmd | cmd | ... 
+//   describes a chain of commands to be piped in line.
+// - pipeline p { cmd{ "ls", "-l" } | cmd{ "sort" } | cmd{ "grep", "cpp" },
+//   process::STDOUT }; runs all the commands in the chain at once, with stdin of the 
+//   first command and stdout and stderr of the last command specified just like for 
+//   process. (The stderr specified is shared by all commands.)
+// - p.wait() waits for all the commands to terminate, and returns their exitcodes.
+// - p.pipefail() returns the exitcode of the last (rightmost) command that failed (with 
+//   nonzero exitcode), or 0 if all commands succeeded, just like "set -o pipefail" does 
+//   in bash.
+// - p[i] returns the process running the i-th command.
+// - p.usage() returns the resources used by all the commands (as of the last wait()), 
+//   added up, while p[i].usage has those of each command.
+// - pipeline p { fd0, chain, fd1, fd2, opts }; runs each command with opts (of 
+//   process::options). If opts.pgid is 0, all the commands are put in a new process 
+//   group led by the first command, so that they can be signaled at once.
+// - p.deadline(timeout, grace) has reaper wait for all the commands, and terminate them 
+//   (or their process group) if still running after timeout, with SIGTERM and then 
+//   SIGKILL after grace (see reaper.hpp).
+//
+// Unlike nesting temporary processes like process{ process{ ... }.stdout, ... }, all 
+// the processes are kept in pipeline, so that they can be waited for and will not be 
+// left as defunct processes. Intermediate pipes are not kept open in parent process, so 
+// that a command can see EOF or SIGPIPE as soon as its neighbor terminates.
+
+
+
+#pragma once
+
+#include "process.hpp"
+// <chrono>: chrono::steady_clock::now(), chrono::milliseconds, chrono::ceil<>
+// <string>: string, .c_str()
+// <vector>: vector<>, .push_back(), .reserve(), .emplace_back()
+// <initializer_list>: initializer_list<>
+
+#include "reaper.hpp"  // reaper::adopt()
+
+
+
+struct cmd {
+    std::vector<std::string> argv;
+
+    cmd(std::initializer_list<std::string> args): argv(args) {}
+    explicit cmd(std::vector<std::string> args): argv(std::move(args)) {}
+};
+
+struct cmds {
+    std::vector<cmd> list;
+};
+
+inline cmds operator|(cmd a, cmd b) { return cmds { { std::move(a), std::move(b) } }; }
+inline cmds operator|(cmds a, cmd b) { a.list.push_back(std::move(b)); return a; }
+
+
+
+class pipeline {
+private:
+    std::vector<process> _procs;
+    std::vector<int> _exitcodes;
+
+public:
+    enum { DEVNULL = process::DEVNULL };
+
+    explicit pipeline(int fd0, const cmds& chain, int fd1 =DEVNULL, int fd2 =DEVNULL)
+    : pipeline(fd0, chain, fd1, fd2, process::options()) {}
+    explicit pipeline(int fd0, const cmds& chain, int fd1, int fd2,
+	const process::options& opts);
+
+    pipeline(const cmds& chain, int fd1 =DEVNULL, int fd2 =DEVNULL)
+    : pipeline(DEVNULL, chain, fd1, fd2) {}
+    // not explicit, so that we can write "pipeline p = cmd{ ... } | cmd{ ... };".
+
+    // pipeline is movable (with its processes) but not copyable.
+    pipeline(pipeline&&) =default;
+    pipeline(const pipeline&) =delete;
+    pipeline& operator=(const pipeline&) =delete;
+
+    // Like process, child processes are not killed nor waited for when pipeline is 
+    // destroyed.
+
+    size_t size() const { return _procs.size(); }
+    process& operator[](size_t i) { return _procs[i]; }
+
+    process& front() { return _procs.front(); }  // e.g, front().stdin for process::PIPE
+    process& back() { return _procs.back(); }  // e.g, back().stdout for process::PIPE
+
+    // wait for all processes to terminate indefinitely, returning their exitcodes.
+    const std::vector<int>& wait();
+
+    // wait for all processes to terminate for the duration of timeout, returning true if 
+    // all terminated, or false if timed out.
+    bool wait(const std::chrono::milliseconds& timeout);
+
+    // exitcodes of processes (as of the last wait())
+    const std::vector<int>& exitcodes() const { return _exitcodes; }
+
+    // exitcode of the last process that failed, or 0 if all succeeded
+    int pipefail() const;
+
+    // resources used by processes (as of the last wait()), added up
+    resource_usage usage() const;
+
+    // have reaper wait for all processes, and terminate them together if still running 
+    // after timeout.
+    void deadline(const std::chrono::milliseconds& timeout,
+	const std::chrono::milliseconds& grace =std::chrono::seconds(5));
+};
+
+pipeline::pipeline(int fd0, const cmds& chain, int fd1, int fd2,
+    const process::options& opts)
+:   _exitcodes(chain.list.size(), process::UNKNOWN)
+{
+    _procs.reserve(chain.list.size());
+
+    try {
+	process::options each_opts = opts;
+	int in = fd0;
+	for ( size_t i = 0 ; i < chain.list.size() ; ++i ) {
+	    std::vector<const char*> argv;
+	    for ( const auto& each: chain.list[i].argv )
+		argv.push_back(each.c_str());
+	    argv.push_back(nullptr);
+
+	    const bool last = ( i + 1 == chain.list.size() );
+	    _procs.emplace_back(in, argv.data(), last ? fd1 : process::PIPE, fd2,
+		each_opts);
+	    if ( i == 0 && opts.pgid == 0 )
+		each_opts.pgid = _procs.front().pid;  // The rest join the first one.
+
+	    if ( i > 0 ) {
+		// The previous process does not need its stdout any longer, which is now 
+		// inherited by the current process as its stdin.
+		process& prev = _procs[i - 1];
+		instrument::_unwatch(prev._stdout);
+		::close(prev._stdout);
+		prev._stdout = DEVNULL;
+	    }
+	    in = _procs.back()._stdout;
+	}
+    }
+    catch ( ... ) {
+	// Processes launched so far will see EOF or SIGPIPE as we close their pipes, and 
+	// reaper will reap them when they terminate.
+	for ( auto& p: _procs )
+	    reaper::adopt(p);
+	throw;
+    }
+}
+
+const std::vector<int>& pipeline::wait()
+{
+    for ( size_t i = 0 ; i < _procs.size() ; ++i ) {
+	_procs[i].wait();
+	_exitcodes[i] = _procs[i].exitcode;
+    }
+
+    return _exitcodes;
+}
+
+bool pipeline::wait(const std::chrono::milliseconds& timeout)
+{
+    using namespace std::chrono_literals;
+    const auto when = std::chrono::steady_clock::now() + timeout;
+
+    for ( size_t i = 0 ; i < _procs.size() ; ++i ) {
+	// rounded up, not to give up before the timeout
+	const auto remaining =
+	    std::chrono::ceil<std::chrono::milliseconds>(
+		when - std::chrono::steady_clock::now() );
+	if ( !_procs[i].wait(std::max(remaining, 0ms)) )
+	    return false;
+	_exitcodes[i] = _procs[i].exitcode;
+    }
+
+    return true;
+}
+
+resource_usage pipeline::usage() const
+{
+    resource_usage total;
+    for ( const auto& p: _procs )
+	total += p.usage;
+    return total;
+}
+
+void pipeline::deadline(const std::chrono::milliseconds& timeout,
+    const std::chrono::milliseconds& grace)
+{
+    std::vector<process_handle*> ps;
+    for ( auto& p: _procs )
+	ps.push_back(&p);
+    reaper::adopt(ps.data(), ps.size(), timeout, grace);
+}
+
+int pipeline::pipefail() const
+{
+    for ( auto it = _exitcodes.rbegin() ; it != _exitcodes.rend() ; ++it )
+	if ( *it != 0 )
+	    return *it;
+
+    return 0;
+}
@@ -8,41 +8,149 @@
 #pragma once
 
 #include <algorithm>  // min()
+#include <atomic>  // atomic<>
 #include <cassert>  // assert()
 
 #include "_pipe.hpp"
-// <cstdlib>: _Exit()
+// <cstdlib>: _Exit(), getenv()
 // <system_error>: system_error(), system_category(), errno
-// <unistd.h>: STD*_FILENO, close(), fork(), execvp()
-
-#include <mutex>  // mutex, lock_guard<>, unique_lock<>, once_flag, call_once()
-#include <condition_variable>
-    // condition_variable, .notify_one(), .notify_all(), .wait(), .wait_for()
+// <unistd.h>: STD*_FILENO, close(), dup2(), fork(), execve(), execvpe(), chdir(), 
+//   fchdir(), pipe2(), nice(), setpgid()
+// <fcntl.h>: fcntl(), open(), openat(), O_CLOEXEC, O_TMPFILE
+
+#include <mutex>  // once_flag, call_once()
+#include <shared_mutex>  // shared_mutex, shared_lock<>, unique_lock<>
+#include <map>  // map<>, .find(), .emplace(), .clear()
+#include <new>  // nothrow
+#include <cstring>  // strchr(), strchrnul(), strlen(), memcpy()
 #include <chrono>
     // chrono::steady_clock::now(), chrono_literals, chrono::milliseconds, 
-    // chrono::duration_cast<>
+    // chrono::duration_cast<>, chrono::ceil<>
 #include <thread>  // this_thread::sleep_for()
 
+#include "instrument.hpp"
+// <atomic>: atomic<>
+// <chrono>: chrono::steady_clock
+
 #include <string>  // basic_string<>, string, .c_str()
+#include <string_view>  // string_view
 // <stdio.h>: dprintf()
-#include <vector>  // vector<>, .push_back(), .shrink_to_fil(), .data()
+#include <vector>  // vector<>, .reserve(), .push_back(), .data()
 // <initializer_list>: initializer_list<>
 
 extern "C" {
-#include <sys/wait.h>  // waitpid(), WNOHANG, WEXITSTATUS, ...
+#include <sys/wait.h>  // waitpid(), wait4(), WNOHANG, WEXITSTATUS, ...
+#include <sys/resource.h>  // rusage
 // <signal.h>: kill(), SIGKILL
+#include <signal.h>  // sigaction(), sigfillset(), pthread_sigmask(), _NSIG
+#include <sched.h>
+    // clone(), CLONE_VM, CLONE_VFORK, sched_setaffinity(), cpu_set_t, CPU_SET(), 
+    // sched_setscheduler(), sched_param
+#include <sys/mman.h>  // mmap(), munmap()
+#include <sys/syscall.h>
+    // syscall(), SYS_pidfd_open, SYS_clone3, SYS_set_mempolicy, SYS_ioprio_set, 
+    // SYS_memfd_create
+#include <poll.h>  // poll(), POLLIN
+#include <sys/ioctl.h>  // ioctl(), FIONREAD
+#include <sys/stat.h>  // fstat(), S_ISREG()
+#include <linux/futex.h>  // FUTEX_WAIT_PRIVATE, FUTEX_WAKE_PRIVATE
+#include <limits.h>  // INT_MAX, PATH_MAX
+#include <time.h>  // timespec
 }
 
 
 
-class process {
+class uring;  // in uring.hpp
+class command;  // in command.hpp
+class zygote;  // in zygote.hpp
+template <typename Framing> class coprocess;  // in coprocess.hpp
+struct inline_executor;  // in coroutine.hpp
+
+// resources used by child process, as reported by ::wait4() when reaped
+struct resource_usage {
+    std::chrono::microseconds user { 0 };  // CPU time spent in user mode
+    std::chrono::microseconds system { 0 };  // CPU time spent in kernel mode
+    long maxrss = 0;  // maximum resident set size in KB
+    long majflt = 0;  // number of major page faults (that required I/O)
+    long nvcsw = 0;  // number of voluntary context switches (e.g, waiting for I/O)
+    long nivcsw = 0;  // number of involuntary context switches (preempted)
+    std::chrono::microseconds runtime { 0 };  // wall-clock time from spawn to reap
+
+    // add up r into *this, e.g, for the total of a pipeline. (maxrss becomes the 
+    // largest of them, as getrusage(RUSAGE_CHILDREN) does, and runtime the sum.)
+    resource_usage& operator+=(const resource_usage& r) {
+	user += r.user;
+	system += r.system;
+	maxrss = std::max(maxrss, r.maxrss);
+	majflt += r.majflt;
+	nvcsw += r.nvcsw;
+	nivcsw += r.nivcsw;
+	runtime += r.runtime;
+	return *this;
+    }
+};
+
+// process_handle is the part of process (see below) that is all it takes to wait for 
+// child process and to own its pipes, so as to be kept in large tables compactly:
+// - process_handle h { std::move(proc) }; or h = std::move(proc); takes over child 
+//   process and its pipes from proc (of process), leaving proc without them.
+// - h.pid(), h.exitcode(), h.usage(), h.stdin(), h.stdout(), and h.stderr() return what 
+//   proc.pid, proc.exitcode, proc.usage, ... do, and h.wait(), h.poll(), ... work the 
+//   same as proc.wait(), proc.poll(), ... do.
+// - process_handle h; (by default constructor) has no child process, like a moved-from 
+//   one, and is done running already.
+// - process_handle is move-assignable, so can be put in std::vector with .push_back() and 
+//   in std::unordered_map with operator[], which process itself cannot be without const 
+//   reference members such as proc.pid.
+//
+// It takes 64 bytes (on 64-bit) without any mutex or condition variable, since those 
+// waiting for child process sleep on the futex word _running. Adopters (e.g, reaper) 
+// keep what they need for waiting in their own tables, only for the processes adopted. 
+// The resource usage (of 56 bytes) is kept out of line, allocated only once child 
+// process has terminated, while process keeps it in itself instead.
+
+class process_handle {
+    friend class process;
+    friend class reaper;
+    friend class process_group;
+    friend class pipeline;
+    friend class uring;
+    template <typename Framing> friend class coprocess;
+
 private:
-    template <typename CharT, typename Traits, typename Allocator>
-    static std::vector<const CharT*> _to_vector(
-	std::initializer_list<std::basic_string<CharT, Traits, Allocator>> args);
+    // change _running from ALONE to AWAITED, returning true if changed, or false if done 
+    // already or some other thread is waiting for child. (If some thread is in poll(), 
+    // wait for it to finish first.)
+    bool _await();
 
-    template <typename =void>  // bogus template to have the definition in .hpp
-    static int _fd_or_devnull(int fd);  // return fd of /dev/null if fd == DEVNULL.
+    // sleep while _running is still running (AWAITED or POLLING) for the duration of 
+    // timeout, or indefinitely if timeout == nullptr.
+    void _sleep(int running, const timespec* timeout);
+
+    // set _running from AWAITED or POLLING to running (DONE or ALONE), waking up threads 
+    // sleeping on it.
+    void _publish(int running);
+
+    // return pidfd of child process, opening it at the first call, or -1 if pidfd is not 
+    // supported by system.
+    int _open_pidfd();
+
+    // return exitcode from status of ::waitpid().
+    static int _exitcode_of(int status);
+
+    // set _exitcode and *_usage (allocating it if nullptr) from status and ru of 
+    // ::wait4().
+    void _reaped(int status, const struct rusage& ru);
+
+    // take over child process and fds from h, leaving h without them.
+    void _take(process_handle& h);
+
+    // take over *_usage from h (by copy, or by pointer if h owns it and we have none), 
+    // leaving h with all 0.
+    void _take_usage(process_handle& h);
+
+    // release child process (from adopter) and close fds.
+    void _release();
 
 protected:
     pid_t _pid = 0; // of child process
@@ -50,26 +158,230 @@ protected:
     enum {
 	DONE	= 0,	// child is done running (terminated)
 	ALONE	= 1,	// no thread is waiting for child
-	AWAITED = 2	// some thread is waiting for child
-    } _running = DONE;  // indicates if child process is running.
+	AWAITED = 2,	// some thread is waiting for child
+	POLLING = 3,	// some thread is checking child in poll()
+	SLEEPING = 4	// flag for AWAITED or POLLING that some threads sleep on _running
+    };
+    std::atomic<int> _running { DONE };  // indicates if child process is running.
     int _exitcode = UNKNOWN;	 // exitcode of child process if terminated
+    int _killed = 0;  // signal sent by reaper at the deadline of child process, or 0
+    resource_usage* _usage = nullptr;  // of child process if terminated, or nullptr
+    std::chrono::steady_clock::time_point _spawned;  // when child process was spawned
+
+    // _running is a futex word, which threads sleep on (setting SLEEPING) until the 
+    // thread that has set it to AWAITED or POLLING publishes DONE (with _exitcode) or 
+    // ALONE with the release semantics. So, once DONE, poll() costs just one load (with 
+    // the acquire semantics), and nobody takes a mutex or makes a system call for it.
+
+    // An adopter (e.g, reaper in reaper.hpp) waits for child process on behalf of all 
+    // threads, keeping _running at AWAITED until it publishes _exitcode and DONE.
+    struct _adopter {
+	virtual void _forget(process_handle& p) =0;  // p is about to be destroyed.
+	virtual void _moved(process_handle& from, process_handle& to) =0;
+	    // from is moved to to, copying _adopted_by as well.
+    };
+    std::atomic<_adopter*> _adopted_by { nullptr };  // until released by adopter or moved
+	// Adopter sets and clears it (with the release semantics) under its own mutex, 
+	// while we read it (with the acquire semantics) without.
+
+    // return adopter of us, or nullptr if none, in which case an adopter that has just 
+    // released us has also finished publishing to us (that is, will not touch us).
+    _adopter* _settled_adopter();
+
+    int _stdin  = -1;  // process::DEVNULL
+    int _stdout = -1;
+    int _stderr = -1;
 
-    std::mutex _mtx_running;	 // mutex protecting _running and _exitcode
-    std::condition_variable _not_awaited;  // waiter for _running != AWAITED
+    enum { NO_PIDFD = -2 };  // pidfd_open() is not supported by kernel (< 5.3).
+    std::atomic<int> _pidfd { -1 };  // pidfd of child process, opened lazily
+	// A pidfd becomes readable when child process terminates, so that we can poll() 
+	// for child process, which is not possible with waitpid().
 
-    int _stdin  = DEVNULL;
-    int _stdout = DEVNULL;
-    int _stderr = DEVNULL;
+    bool _owns_usage = false;  // if _usage has been allocated by us (i.e, not process)
+    static inline const resource_usage _no_usage {};  // for usage() while nullptr
+
+    // for process, which keeps resource usage in itself
+    explicit process_handle(resource_usage& usage): _usage { &usage } {}
+
+public:
+    static constexpr int UNKNOWN = -127;  // unknown exitcode
+
+    // handle without child process
+    process_handle() {}
+
+    // process_handle is movable, from process as well, using either move constructor or 
+    // move assignment. The behaviour of accessing h (from current thread or other 
+    // thread) after "g = std::move(h);" is undefined, as is that of moving into or out of 
+    // g that other threads are accessing (e.g, waiting for) at the same time.
+    process_handle(process_handle&& h) { _take(h); }
+    process_handle& operator=(process_handle&& h);
+
+    // process_handle is not copyable.
+    process_handle(const process_handle&) =delete;
+    process_handle& operator=(const process_handle&) =delete;
+
+    ~process_handle() { _release(); if ( _owns_usage ) delete _usage; }
+    // Child process is not killed as process object is destroyed, so that we can 
+    // pipeline multiple processes in line with creating temporary processes. Thus, 
+    // explicit wait() and/or kill() is required not to make child process an orphan. 
+    // However, fds created for process::PIPEs are destroyed along with process object 
+    // since they are embedded (as a target for standard streams) in actual system 
+    // process and do not need to be exposed outside.
+
+    pid_t pid() const { return _pid; }  // of child process
+    int exitcode() const { return _exitcode; }  // as of the last poll() or wait()
+    const resource_usage& usage() const  // all 0 until terminated
+    { return _usage ? *_usage : _no_usage; }
+    int killed() const { return _killed; }  // SIGTERM or SIGKILL if timed out, or 0
+    int stdin() const { return _stdin; }
+    int stdout() const { return _stdout; }
+    int stderr() const { return _stderr; }
+
+    // wait for child process to terminate indefinitely.
+    void wait();
+
+    // wait for child process to terminate for the duration of timeout, returning true if 
+    // terminated, or false if timed out (child process is still running).
+    bool wait(const std::chrono::milliseconds& timeout);
+
+    // bool wait(timeout) uses ::poll() on pidfd of child process instead of signal 
+    // handler for SIGCHLD, waking up as soon as child process terminates. (On older 
+    // kernels without pidfd, it falls back to a busy-polling loop of non-blocking call of 
+    // ::waitpid() and short sleeps.) However, when multiple threads wait for the same 
+    // child process at the same time, they do not race but they help each other; one of 
+    // them voluntarily waits polling and the others wait just for him. If his time is up 
+    // and he cannot wait any longer, another one among the others waits voluntarily in 
+    // place of him, and so on.
+
+    // check if child process has terminated, returning true if so, or false otherwise.
+    bool poll();  // is the same as wait(0ms), only more optimized.
+
+    // poll() should be used over directly inquiring _running, because _running holds 
+    // only the information of the last poll() or wait() executed.
+
+    // send the specified signal or SIGTERM (=15) to the child.
+    void kill(int sig =SIGKILL);
+
+#if __cplusplus >= 202002L
+    // return an awaitable for child process to terminate (see coroutine.hpp), which 
+    // resumes the awaiting coroutine through ex with the exitcode.
+    template <typename Executor =inline_executor>
+    auto async_wait(Executor ex ={});
+    template <typename Executor =inline_executor>
+    auto async_wait(uring& ring, Executor ex ={});
+#endif
+};
+
+
+
+class process: public process_handle {
+    friend class reaper;
+    friend class process_group;
+    friend class pipeline;
+    friend class uring;
+    friend class zygote;
+    template <typename Framing> friend class coprocess;
+
+private:
+    resource_usage _own_usage;  // that _usage points to, not to be allocated
+
+    template <typename CharT, typename Traits, typename Allocator>
+    static std::vector<const CharT*> _to_vector(
+	std::initializer_list<std::basic_string<CharT, Traits, Allocator>> args);
+
+    template <typename =void>  // bogus template to have the definition in .hpp
+    static int _fd_or_devnull(int fd);  // return fd of /dev/null if fd == DEVNULL.
+
+    // resolve file into path by searching $PATH as execvp() does, returning true if 
+    // found, caching the result for the same file (and $PATH) next time.
+    template <typename =void>
+    static bool _resolve(const char* file, char (&path)[PATH_MAX]);
+
+    // drop file from the cache, e.g, if the path cached has failed to exec*().
+    static void _unresolve(const char* file);
+
+    struct _path_cache {
+	std::shared_mutex mtx;  // for the members below
+	std::string env;  // $PATH the cache is for
+	std::map<std::string, std::string, std::less<>> paths;
+	    // of std::less<> to find() by const char* without creating std::string
+    };
+    static inline _path_cache _paths;
+
+    struct _placement {  // options::cpus, ... prepared not to allocate memory in child
+	bool has_cpus;
+	cpu_set_t cpus;
+	bool has_mems;
+	unsigned long mems[1024 / (8 * sizeof(unsigned long))];  // nodemask of 1024 nodes
+	int nice;
+	int ioprio;  // IOPRIO_PRIO_VALUE(ioclass, iolevel), or 0 to inherit
+	int policy;
+	int priority;
+	pid_t pgid;  // or -1 to stay in our process group
+	int cgroup;  // fd of cgroup directory, or -1 not to move child
+	int procs;  // fd of cgroup.procs in it (for writing), or -1
+    };
+
+    struct _spawn {  // what child process needs to know from parent
+	int fds[3];  // nears that child's stdin/stdout/stderr are redirected to
+	const char* const* argv;
+	const char* const* envp;  // or nullptr to inherit environ
+	const char* cwd;  // to chdir() into, or nullptr not to
+	int cwdfd;  // to fchdir() into (before cwd), or -1 not to
+	const char* path;  // argv[0] resolved from $PATH, or nullptr if not resolved
+	int report;  // (O_CLOEXEC) pipe to write errno into if failed to exec*()
+	bool vforked;  // true if child shares memory with parent until exec*().
+	sigset_t sigmask;  // original signal mask of parent (only if vforked)
+	const _placement* place;  // placement to apply, or nullptr if none
+	bool in_cgroup;  // true if spawned into place->cgroup by clone3() already
+    };
+
+    // spawn child process using fork() or clone(CLONE_VM|CLONE_VFORK).
+    static pid_t _fork(_spawn& sp);
+    static pid_t _vfork(_spawn& sp);
+    static int _clone_entry(void* sp);
+
+    // spawn child process through fork server, installed by zygote::start().
+    static inline std::atomic<pid_t (*)(_spawn& sp)> _zygote { nullptr };
+
+    // redirect child's standard streams and exec*(), running in child process!
+    [[noreturn]] static void _exec(const _spawn& sp) noexcept;
+
+    // report errno to parent through report and exit, running in child process!
+    [[noreturn]] static void _fail(int report) noexcept;
+
+    // apply sp.place to ourselves, running in child process!
+    static void _place(const _spawn& sp, int report) noexcept;
+
+    // set FD_CLOEXEC on all fds >= lowfd, running in child process!
+    static void _cloexec_from(int lowfd) noexcept;
+
+    // communicate() until when, or indefinitely if when == nullptr.
+    bool _communicate(std::string_view input, std::string& out, std::string& err,
+	const std::chrono::steady_clock::time_point* when);
+
+    // append to s what is available from fd, returning the result of ::read().
+    static ssize_t _read_some(int fd, std::string& s);
+
+    // return how many bytes can be read from fd without blocking (FIONREAD), or 0.
+    static size_t _readable(int fd);
 
 public:
     const pid_t& pid = _pid; // of child process
 
     // No const reference for _running is provided, use !poll() instead.
 
-    static constexpr int UNKNOWN = -127;  // unknown exitcode
-    const int& exitcode = _exitcode;
+    const int& exitcode = _exitcode;  // UNKNOWN (= -127) if not known yet
+
+    // resources used by child process, all 0 until terminated (and reaped)
+    const resource_usage& usage = _own_usage;
+
+    // signal sent last by reaper as child process ran past its deadline (SIGTERM, or 
+    // SIGKILL after the grace period), or 0 if not timed out (see reaper.hpp)
+    const int& killed = _killed;
 
     enum {
+	MEMFD	= -4,  // MEMFD can be specified only for stdout or stderr.
 	SAMEOUT = -3,  // SAMEOUT can be specified only for stderr.
 	PIPE	= -2,
 	DEVNULL = -1,  // -1 is intentional to match invalid fd in _pipe<> class.
@@ -82,8 +394,109 @@ public:
     const int& stdout = _stdout;
     const int& stderr = _stderr;
 
+    // With MEMFD, child writes its stdout (or stderr) into a memory file (memfd_create()) 
+    // instead of a pipe, or into a temporary file in options::capture_dir, which 
+    // proc.stdout (or proc.stderr) refers to. Child never blocks on a full pipe, and no 
+    // read() nor context switch is needed for each chunk of output, which can then be 
+    // viewed in place after wait() using mapping (see mapping.hpp) without copying.
+
+    enum backend_t {
+	FORK,  // fork(), which copies the page tables of parent process.
+	VFORK,	// clone(CLONE_VM|CLONE_VFORK), which shares memory with parent until 
+		// exec*() while parent is suspended.
+	ZYGOTE	// fork server started by zygote::start() (see zygote.hpp), which falls 
+		// back to FORK if not started.
+    };
+
+    // backend used for spawning child processes from now on
+    static inline std::atomic<backend_t> backend { FORK };
+
+    // fork() gets slower as parent process gets bigger (in RSS) and stalls other threads 
+    // of parent process while copying page tables, but VFORK keeps the spawn cost flat 
+    // regardless of memory size of parent process. ZYGOTE has a small helper process 
+    // (started early) fork child processes for us, not depending on our memory size or 
+    // number of threads at all. All backends keep the same semantics of redirection for 
+    // stdin/stdout/stderr.
+
+    // options for spawning child process
+    struct options {
+	int capacity[3] = { 0, 0, 0 };
+	    // capacities in bytes of pipes for stdin/stdout/stderr (if process::PIPE), or 
+	    // 0 for system default (64KB on Linux). Capacity is rounded up to a power of 2 
+	    // pages by system, and bounded by /proc/sys/fs/pipe-max-size (1MB by default) 
+	    // unless privileged, for which we can just get what is granted, using 
+	    // process::capacity(fd) afterwards.
+
+	// Placement of child process below is applied in child process before exec*(), 
+	// so before the command runs at all, and spawning fails with system_error if any 
+	// of them fails (e.g, EPERM for a negative nice or SCHED_FIFO without privilege).
+	std::vector<int> cpus;  // CPUs to run on (sched_setaffinity()), or empty to inherit
+	std::vector<int> mems;
+	    // NUMA nodes to allocate memory only from (set_mempolicy() of MPOL_BIND), or 
+	    // empty to inherit
+	int nice = 0;  // increment of nice value (e.g, 10 for background jobs), or 0
+
+	enum { IO_INHERIT, IO_RT, IO_BE, IO_IDLE };  // classes of ioprio_set()
+	int ioclass = IO_INHERIT;
+	int iolevel = 4;  // from 0 (highest) to 7 (lowest) in ioclass of IO_RT or IO_BE
+
+	int policy = -1;  // SCHED_OTHER, SCHED_BATCH, SCHED_IDLE, ..., or -1 to inherit
+	int priority = 0;  // sched_priority for policy (1 to 99 for SCHED_FIFO, SCHED_RR)
+
+	std::string cgroup;
+	    // cgroup directory to run in (e.g, "/sys/fs/cgroup/workers"), or empty to 
+	    // inherit
+
+	pid_t pgid = -1;
+	    // process group to join (setpgid()), 0 for a new one led by child process, 
+	    // or -1 to stay in ours
+
+	std::string capture_dir;
+	    // directory (on disk) to create temporary files (O_TMPFILE) in for MEMFD, or 
+	    // empty for memory files, which use RAM (or swap) while kept open
+
+	const char* const* envp = nullptr;
+	    // environment (of "NAME=value", terminated by nullptr) for child process to 
+	    // run with (e.g, environment::envp() of environment.hpp), or nullptr to 
+	    // inherit environ. It is passed to execve() as is, so should be kept alive 
+	    // until the constructor returns. (The environment of command wins if set.)
+	int cwdfd = -1;
+	    // fd of directory for child process to run in by fchdir() (e.g, opened once 
+	    // by open(dir, O_PATH | O_DIRECTORY | O_CLOEXEC) for many spawns), or -1 to 
+	    // run in ours. The working directory of command is relative to it if set.
+    };
+
+    // A process group lets the whole tree of child process (e.g, of a pipeline or a 
+    // shell script) be signaled at once with ::kill(-pgid), as reaper does at deadlines.
+
+    // cpus and mems together place child process on a NUMA node, without numactl or 
+    // taskset in front of the command, e.g, for process_pool to spread slots across 
+    // sockets. With FORK, child process is spawned right into cgroup using clone3() of 
+    // CLONE_INTO_CGROUP (Linux >= 5.7), otherwise it moves itself into cgroup.
+
+private:
+    // create pipes and spawn child process, run by constructors.
+    void _start(int fd0, int fd1, int fd2, const char* const argv[],
+	const char* const envp[], const char* cwd, const options& opts);
+
+    // create a file for MEMFD, with nothing linked to it in file system.
+    static int _memfd(const options& opts, const char* name);
+
+    // prepare pl from opts in parent, returning false if there is nothing to apply. 
+    // (The fds opened into pl, if any, are to be closed by _unprepare().)
+    static bool _prepare(const options& opts, _placement& pl);
+    static void _unprepare(_placement& pl);
+
+public:
+
     // native constructor
-    explicit process(int fd0, const char* argv[], int fd1, int fd2);
+    explicit process(int fd0, const char* const argv[], int fd1, int fd2);
+    explicit process(int fd0, const char* const argv[], int fd1, int fd2,
+	const options& opts);
+
+    // spawn command prepared (see command.hpp), without allocating memory.
+    explicit process(const command& cmd);
+    explicit process(const command& cmd, const options& opts);
 
     explicit process( int fd0, std::initializer_list<std::string> args,
 	int fd1 =DEVNULL, int fd2 =DEVNULL )
@@ -93,62 +506,96 @@ public:
 	int fd1 =DEVNULL, int fd2 =DEVNULL )
     : process(DEVNULL, _to_vector(args).data(), fd1, fd2) {}
 
-    // process is movable using move constructor (but not move assignment).
-    // The behaviour of accessing q (from current thread or other thread) after "process 
-    // p { std::move(q) };" is undefined.
-    process(process&& p);
+    explicit process( int fd0, std::initializer_list<std::string> args,
+	int fd1, int fd2, const options& opts )
+    : process(fd0, _to_vector(args).data(), fd1, fd2, opts) {}
 
-    // We do not support default constructor and move assignment. If we want to have a 
-    // container with processes as its elements, we can use .emplace*() on it instead of 
-    // .push*() or .insert().
+    explicit process( std::initializer_list<std::string> args,
+	int fd1, int fd2, const options& opts )
+    : process(DEVNULL, _to_vector(args).data(), fd1, fd2, opts) {}
+
+    // process is movable, and move-assignable, just like process_handle is (but into 
+    // process_handle as well), with the const reference members kept referring to its 
+    // own process_handle. The behaviour of accessing q (from current thread or other 
+    // thread) after "process p { std::move(q) };" or "p = std::move(q);" is undefined.
+    process(process&& p): process_handle(_own_usage) { _take(p); }
+    process& operator=(process&& p)
+    { process_handle::operator=(std::move(p)); return *this; }
+
+    // We do not support default constructor, which would leave nothing to do. If we 
+    // want a table with many processes, we can keep them as process_handles instead.
     process() =delete;
-    process& operator=(process&&) =delete;
 
     // process is not copyable.
     process(const process&) =delete;
     process& operator=(const process&) =delete;
 
-    ~process();
-    // Child process is not killed as process object is destroyed, so that we can 
-    // pipeline multiple processes in line with creating temporary processes. Thus, 
-    // explicit wait() and/or kill() is required not to make child process an orphan.
-    // However, fds created for process::PIPEs are destroyed along with process object 
-    // since they are embedded (as a target for standard streams) in actual system 
-    // process and do not need to be exposed outside.
-
-    // wait for child process to terminate indefinitely.
-    void wait();
-
-    // wait for child process to terminate for the duration of timeout, returning true if 
-    // terminated, or false if timed out (child process is still running).
-    bool wait(const std::chrono::milliseconds& timeout);
-
-    // bool wait(timeout) uses a busy-polling loop (non-blocking call of ::waitpid() and 
-    // short sleeps) instead of signal handler for SIGCHLD. However, when multiple 
-    // threads wait for the same child process at the same time, they do not race but 
-    // they help each other; one of them voluntarily waits polling and the others wait 
-    // just for him. If his time is up and he cannot wait any longer, another one among 
-    // the others waits voluntarily in place of him, and so on.
+    // return capacity of the pipe that fd refers to (e.g, proc.stdout), or -1 if fd is 
+    // not a pipe.
+    static int capacity(int fd) { return ::fcntl(fd, F_GETPIPE_SZ); }
+
+    // write input into stdin and read stdout and stderr into out and err at the same time 
+    // (for those of process::PIPE), until child closes stdout and stderr, and wait for 
+    // child process to terminate. The stdin gets closed after all input is written.
+    void communicate(std::string_view input, std::string& out, std::string& err)
+    { _communicate(input, out, err, nullptr); }
+
+    // the same as above but for the duration of timeout, returning true if terminated, 
+    // or false if timed out. (Outputs read so far are kept in out and err.)
+    bool communicate(std::string_view input, std::string& out, std::string& err,
+	const std::chrono::milliseconds& timeout) {
+	const auto when = std::chrono::steady_clock::now() + timeout;
+	return _communicate(input, out, err, &when);
+    }
 
-    // check if child process has terminated, returning true if so, or false otherwise.
-    bool poll();  // is the same as wait(0ms), only more optimized.
+    // read from fd (e.g, proc.stdout) until EOF and append to s, returning the number of 
+    // bytes read. hint is the expected number of bytes, if known, to reserve s for.
+    static size_t read_all(int fd, std::string& s, size_t hint =0);
+
+    // the same as above but returning a new string.
+    static std::string read_all(int fd, size_t hint =0)
+    { std::string s; read_all(fd, s, hint); return s; }
+
+    // read_all() reserves s for hint, or for the size of file if fd refers to a regular 
+    // file, and reads directly into s instead of an intermediate buffer. Each read() is 
+    // as big as what is ready to read in the pipe (FIONREAD) or 64KB at least, and the 
+    // capacity of s grows twice each time it is filled up. Passing the same string 
+    // (cleared) for the next read_all() reuses its memory like an arena.
+
+    // Writing all input into stdin before reading stdout can deadlock if child process 
+    // fills up the pipe for stdout before reading all its stdin, unless we have a 
+    // separate thread reading stdout. communicate() instead makes the pipes non-blocking 
+    // and multiplexes them in a single ::poll() loop, writing input and reading outputs 
+    // whichever child process is ready for. The outputs are appended to out and err, so 
+    // that the same strings can be reused (with their capacities) for next processes.
+};
 
-    // poll() should be used over directly inquiring _running, because _running holds 
-    // only the information of the last poll() or wait() executed.
+process::process(int fd0, const char* const argv[], int fd1, int fd2)
+:   process(fd0, argv, fd1, fd2, options())
+{}
 
-    // send the specified signal or SIGTERM (=15) to the child.
-    void kill(int sig =SIGKILL);
-};
+process::process(int fd0, const char* const argv[], int fd1, int fd2,
+    const options& opts)
+:   process_handle(_own_usage)
+{
+    _start(fd0, fd1, fd2, argv, nullptr, nullptr, opts);
+}
 
-process::process(int fd0, const char* argv[], int fd1, int fd2)
-:   _running { ALONE }
+void process::_start(int fd0, int fd1, int fd2, const char* const argv[],
+    const char* const envp[], const char* cwd, const options& opts)
 {
-    assert(fd0 != SAMEOUT);
+    assert(fd0 != SAMEOUT && fd0 != MEMFD);
     assert(fd1 != SAMEOUT);
 
-    _pipe<false> pipe_in = _fd_or_devnull(fd0);
-    _pipe<true> pipe_out = _fd_or_devnull(fd1);
-    _pipe<true> pipe_err = ( fd2 == SAMEOUT ? pipe_out.near : _fd_or_devnull(fd2) );
+    _pipe<false> pipe_in { _fd_or_devnull(fd0), opts.capacity[0] };
+    _pipe<true> pipe_out { fd1 == MEMFD ? _memfd(opts, "stdout") : _fd_or_devnull(fd1),
+	opts.capacity[1] };
+    if ( fd1 == MEMFD )
+	pipe_out._own();  // to be closed like a pipe, and to be our stdout
+    _pipe<true> pipe_err { fd2 == SAMEOUT ? pipe_out.near
+	: fd2 == MEMFD ? _memfd(opts, "stderr") : _fd_or_devnull(fd2), opts.capacity[2] };
+    if ( fd2 == MEMFD )
+	pipe_err._own();
 
     // The _pipe<> class contains two file descriptors, "far" and "near". The "far" means 
     // file descriptor far fram child process, while "near" is one near to child process. 
@@ -167,276 +614,940 @@ process::process(int fd0, const char* argv[], int fd1, int fd2)
     // cannot close the fd? on its destruction, but if far != -1, as created from inside, 
     // far is thought to be owned by process object and gets closed on the destruction.
 
-    if ( (_pid = ::fork()) == 0 )  // run in child process!
-    {
-	// Redirection cases:
-	// case 1	// case 2	// case 3
-	// 3 <- 0	// 3 <- 0	// 3 <- 0
-	// 3 <- 1	// 1 <- 1	// 2 <- 1
-	// 2 <- 2	// 2 <- 2	// 2 <- 2
-
-	// case 4	// case 5	// case 6 (swapping)
-	// 3 <- 0	// 3 <- 0	// 3 <- 0
-	// 1 <- 1	// 3 <- 1	// 2 <- 1
-	// 1 <- 2	// 1 <- 2	// 1 <- 2
-	// -->		// -->		// -->
-	// 3 <- 0	// 3 <- 0	// 3 <- 0
-	// 1 <- 2	// 1 <- 2	// 2 <- 4
-	// 1 <- 1	// 3 <- 1	// 1 <- 2
-					// 4 <- 1
-
-	// redirect child's standard streams
-	pipe_in.dup2(STDIN);
-	if ( pipe_err.near == STDOUT ) {    // case 4/5/6
-	    if ( pipe_out.near == STDERR )  // case 6
-		pipe_out.dup2();
-	    pipe_err.dup2(STDERR);
-	    pipe_out.dup2(STDOUT);
-	} else {			    // case 1/2/3
-	    pipe_out.dup2(STDOUT);
-	    pipe_err.dup2(STDERR);
+    // Child reports errno through report if anything fails before exec*(), or closes it 
+    // just by exec*(), which we wait for to throw the error right here.
+    int report[2];
+    if ( ::pipe2(report, O_CLOEXEC) == -1 )
+	throw std::system_error(errno, std::system_category());
+
+    _placement place;
+    bool placed;
+    try {
+	placed = _prepare(opts, place);
+    }
+    catch ( ... ) {
+	::close(report[0]);
+	::close(report[1]);
+	throw;
+    }
+
+    char path[PATH_MAX];
+    _spawn sp { { pipe_in.near, pipe_out.near, pipe_err.near }, argv,
+	envp ? envp : opts.envp, cwd, opts.cwdfd, _resolve(argv[0], path) ? path : nullptr,
+	report[1], false, {}, placed ? &place : nullptr, false };
+
+    const backend_t how = backend.load(std::memory_order_relaxed);
+    const auto zygote = how == ZYGOTE ? _zygote.load(std::memory_order_acquire) : nullptr;
+    _spawned = std::chrono::steady_clock::now();
+    _pid = zygote ? zygote(sp) : how == VFORK ? _vfork(sp) : _fork(sp);
+    int error = _pid == -1 ? errno : 0;
+    if ( _pid != -1 )
+	instrument::_record(instrument::SPAWN, _spawned);
+    ::close(report[1]);
+    if ( placed )
+	_unprepare(place);
+
+    for ( ssize_t n ; _pid != -1
+	&& (n = ::read(report[0], &error, sizeof(error))) != 0 ; )
+	if ( n == -1 && errno != EINTR )
+	    break;
+	else if ( n == sizeof(error) && error == 0 )
+	    _unresolve(argv[0]);  // sp.path failed, but child has searched $PATH again.
+    ::close(report[0]);
+
+    if ( error ) {
+	if ( _pid != -1 )
+	    ::waitpid(_pid, nullptr, 0);  // which has exited already (or is exiting).
+	_pid = 0;
+	throw std::system_error(error, std::system_category());
+    }
+
+    instrument::_record(instrument::EXEC, _spawned);
+    // Process group of child has been settled by child itself before exec*() (or it 
+    // would have reported the error), e.g, for ::kill(-pgid) right away.
+
+    _stdin  = pipe_in .release();
+    _stdout = pipe_out.release();
+    _stderr = pipe_err.release();
+    if ( _stdout != -1 )
+	instrument::_watch(_stdout, _spawned);  // for FIRST_BYTE and END
+    // Note near ends of the pipes are closed here, but far ends are now owned by us.
+
+    _running = ALONE;
+}
+
+int process::_memfd(const options& opts, const char* name)
+{
+    int fd;
+    if ( opts.capture_dir.empty() ) {
+#ifdef SYS_memfd_create
+	constexpr unsigned MFD_CLOEXEC_ = 1U;
+	fd = ::syscall(SYS_memfd_create, name, MFD_CLOEXEC_);
+#else
+	errno = ENOSYS;
+	fd = -1;
+#endif
+	if ( fd == -1 && errno == ENOSYS ) {  // Linux < 3.17
+	    const char* const dir = ::getenv("TMPDIR");
+	    fd = ::open(dir && *dir ? dir : "/tmp", O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
 	}
+    }
+    else
+	fd = ::open(opts.capture_dir.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+
+    if ( fd == -1 )
+	throw std::system_error(errno, std::system_category());
+    return fd;
+}
 
-	// close all fds but stdin/stdout/stderr.
-	pipe_in .close();
-	pipe_out.close();
-	pipe_err.close();
+bool process::_prepare(const options& opts, _placement& pl)
+{
+    pl = { !opts.cpus.empty(), {}, !opts.mems.empty(), {}, opts.nice, 0, opts.policy,
+	opts.priority, opts.pgid, -1, -1 };
+
+    CPU_ZERO(&pl.cpus);
+    for ( int cpu: opts.cpus )
+	if ( cpu < 0 || cpu >= CPU_SETSIZE )
+	    throw std::system_error(EINVAL, std::system_category());
+	else
+	    CPU_SET(cpu, &pl.cpus);
+
+    constexpr int bits = 8 * sizeof(unsigned long);
+    for ( int node: opts.mems )
+	if ( node < 0 || node >= static_cast<int>(sizeof(pl.mems) * 8) )
+	    throw std::system_error(EINVAL, std::system_category());
+	else
+	    pl.mems[node / bits] |= 1UL << (node % bits);
+
+    if ( opts.ioclass != options::IO_INHERIT )
+	pl.ioprio = opts.ioclass << 13 | opts.iolevel;  // IOPRIO_PRIO_VALUE()
+
+    if ( !opts.cgroup.empty() ) {
+	pl.cgroup = ::open(opts.cgroup.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if ( pl.cgroup == -1
+	    || (pl.procs = ::openat(pl.cgroup, "cgroup.procs", O_WRONLY | O_CLOEXEC)) == -1 ) {
+	    const int error = errno;
+	    ::close(pl.cgroup);
+	    throw std::system_error(error, std::system_category());
+	}
+    }
+
+    return pl.has_cpus || pl.has_mems || pl.nice != 0 || pl.ioprio != 0
+	|| pl.policy != -1 || pl.pgid != -1 || pl.cgroup != -1;
+}
+
+void process::_unprepare(_placement& pl)
+{
+    if ( pl.cgroup != -1 ) {
+	::close(pl.cgroup);
+	::close(pl.procs);
+	pl.cgroup = pl.procs = -1;
+    }
+}
+
+pid_t process::_fork(_spawn& sp)
+{
+    sp.vforked = false;
+
+#ifdef SYS_clone3
+    // clone3() of CLONE_INTO_CGROUP spawns child right in the cgroup, without moving it 
+    // there afterwards (which costs a lot more on a busy cgroup hierarchy), and is the 
+    // same as fork() otherwise. We just do not run the handlers of pthread_atfork() 
+    // for child, which does nothing but exec*().
+    if ( sp.place && sp.place->cgroup != -1 ) {
+	struct {  // struct clone_args of <linux/sched.h>
+	    uint64_t flags, pidfd, child_tid, parent_tid, exit_signal, stack, stack_size,
+		tls, set_tid, set_tid_size, cgroup;
+	} args = {};
+	constexpr uint64_t CLONE_INTO_CGROUP_ = 0x200000000ULL;
+	args.flags = CLONE_INTO_CGROUP_;
+	args.exit_signal = SIGCHLD;
+	args.cgroup = sp.place->cgroup;
+
+	const pid_t pid = ::syscall(SYS_clone3, &args, sizeof(args));
+	if ( pid == 0 ) {  // run in child process!
+	    sp.in_cgroup = true;
+	    _exec(sp);
+	}
+	if ( pid != -1
+	    || (errno != ENOSYS && errno != E2BIG && errno != EINVAL && errno != EBADF) )
+	    return pid;
+	// Otherwise, clone3() or CLONE_INTO_CGROUP is not supported (Linux < 5.7), or 
+	// cgroup is not of v2, leaving it to child to move itself.
+    }
+#endif
+
+    const pid_t pid = ::fork();
+    if ( pid == 0 )  // run in child process!
+	_exec(sp);
+
+    return pid;
+}
+
+pid_t process::_vfork(_spawn& sp)
+{
+    // Child process runs on its own stack but shares all the other memory with us until 
+    // it calls exec*(), while we are suspended in ::clone(). The stack needs to be big 
+    // enough only for what ::execvp() puts on it.
+    constexpr size_t stack_size = 64 * 1024;
+    void* const stack = ::mmap(nullptr, stack_size, PROT_READ | PROT_WRITE,
+	MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if ( stack == MAP_FAILED )
+	return -1;
+
+    // Block all signals so that no signal handler of ours can run in child process on 
+    // our memory, until child resets them to default.
+    sigset_t all;
+    ::sigfillset(&all);
+    ::pthread_sigmask(SIG_SETMASK, &all, &sp.sigmask);
+    sp.vforked = true;
+
+    const pid_t pid = ::clone(_clone_entry, static_cast<char*>(stack) + stack_size,
+	CLONE_VM | CLONE_VFORK | SIGCHLD, &sp);
+    const int error = errno;
+
+    ::pthread_sigmask(SIG_SETMASK, &sp.sigmask, nullptr);
+    ::munmap(stack, stack_size);
+
+    errno = error;
+    return pid;
+}
+
+int process::_clone_entry(void* sp)
+{
+    _exec(*static_cast<const _spawn*>(sp));
+}
+
+void process::_exec(const _spawn& sp) noexcept
+{
+    // Nothing here may throw, allocate memory, or modify anything but its local 
+    // variables, because with VFORK we are still running on the memory of parent 
+    // process. Any failure is reported to parent through sp.report, exiting with 127.
+
+    int in = sp.fds[0], out = sp.fds[1], err = sp.fds[2];
+
+    // report might have taken 0, 1, or 2 if parent had closed its stdin, ...
+    int report = sp.report;
+    if ( report <= STDERR
+	&& (report = ::fcntl(report, F_DUPFD_CLOEXEC, STDERR + 1)) == -1 )
+	std::_Exit(127);
+
+    // Redirection cases:
+    // case 1	// case 2	// case 3
+    // 3 <- 0	// 3 <- 0	// 3 <- 0
+    // 3 <- 1	// 1 <- 1	// 2 <- 1
+    // 2 <- 2	// 2 <- 2	// 2 <- 2
+
+    // case 4	// case 5	// case 6 (swapping)
+    // 3 <- 0	// 3 <- 0	// 3 <- 0
+    // 1 <- 1	// 3 <- 1	// 2 <- 1
+    // 1 <- 2	// 1 <- 2	// 1 <- 2
+    // -->		// -->		// -->
+    // 3 <- 0	// 3 <- 0	// 3 <- 0
+    // 1 <- 2	// 1 <- 2	// 2 <- 4
+    // 1 <- 1	// 3 <- 1	// 1 <- 2
+				// 4 <- 1
+
+    // redirect child's standard streams
+    // (::dup2() will yield -1 if near < 0, and do nothing if near == fd.)
+    if ( ::dup2(in, STDIN) == -1 )
+	_fail(report);
+    if ( err == STDOUT ) {		    // case 4/5/6
+	if ( out == STDERR )	    // case 6
+	    // The duplicated fd is created with O_CLOEXEC on, so as not to be 
+	    // inherited by exec*().
+	    if ( (out = ::fcntl(out, F_DUPFD_CLOEXEC, STDERR + 1)) == -1 )
+		_fail(report);
+	if ( ::dup2(err, STDERR) == -1 || ::dup2(out, STDOUT) == -1 )
+	    _fail(report);
+    } else {			    // case 1/2/3
+	if ( ::dup2(out, STDOUT) == -1 || ::dup2(err, STDERR) == -1 )
+	    _fail(report);
+    }
+
+    // We don't need to close nears and fars of the pipes created, because they are all 
+    // created with O_CLOEXEC on and thus will be closed automatically on exec*(). But 
+    // fds of parent process opened without O_CLOEXEC (e.g, by other libraries) would be 
+    // inherited, so we set FD_CLOEXEC on all fds other than stdin/stdout/stderr too, 
+    // with one system call of close_range() (Linux >= 5.11) if possible.
+#ifdef SYS_close_range
+    constexpr unsigned CLOSE_RANGE_CLOEXEC_ = 1U << 2;
+    if ( ::syscall(SYS_close_range, STDERR + 1, ~0U, CLOSE_RANGE_CLOEXEC_) == -1 )
+#endif
+	_cloexec_from(STDERR + 1);
 
 #if !defined(NDEBUG) && defined(DEBUG)  // check if stdout/stderr is writable.
-	dprintf(STDOUT, "Ok to write into \033[33mSTDOUT\033[0m\n");
-	dprintf(STDERR, "Ok to write into \033[33mSTDERR\033[0m\n");
+    dprintf(STDOUT, "Ok to write into \033[33mSTDOUT\033[0m\n");
+    dprintf(STDERR, "Ok to write into \033[33mSTDERR\033[0m\n");
 #endif
 
-	if ( ::execvp(argv[0], const_cast<char**>(argv)) == -1 )
-	    std::_Exit(127);  // instead of std::exit() due to no need for cleaning up.
-		// returning 127 as most shells do.
+    if ( sp.vforked ) {
+	// Signal handlers of parent process would run on the memory of parent process, 
+	// so we reset them to default (but leave ignored signals as is just like 
+	// exec*() does) before unblocking signals.
+	struct sigaction sa;
+	for ( int sig = 1 ; sig < _NSIG ; ++sig )
+	    if ( ::sigaction(sig, nullptr, &sa) == 0
+		&& sa.sa_handler != SIG_IGN && sa.sa_handler != SIG_DFL ) {
+		::sigemptyset(&sa.sa_mask);
+		sa.sa_flags = 0;
+		sa.sa_handler = SIG_DFL;
+		::sigaction(sig, &sa, nullptr);
+	    }
+	::sigprocmask(SIG_SETMASK, &sp.sigmask, nullptr);
     }
 
-    else {  // run in parent process!
-	if ( pid == -1 )
-	    throw std::system_error(errno, std::system_category());
+    if ( sp.place )
+	_place(sp, report);
+
+    if ( sp.cwdfd != -1 && ::fchdir(sp.cwdfd) == -1 )
+	_fail(report);
+    if ( sp.cwd && ::chdir(sp.cwd) == -1 )
+	_fail(report);
 
-	_stdin  = pipe_in .far;
-	_stdout = pipe_out.far;
-	_stderr = pipe_err.far;
-	// Note near ends of the pipes will be closed on exit.
+    char* const* const argv = const_cast<char* const*>(sp.argv);
+    char* const* const envp = sp.envp ? const_cast<char* const*>(sp.envp) : environ;
+    if ( sp.path ) {
+	::execve(sp.path, argv, envp);
 
-	_running = ALONE;
+	// If failed (e.g, removed since cached), we fall back to searching $PATH again, 
+	// telling parent to drop it from the cache by 0.
+	const int zero = 0;
+	::write(report, &zero, sizeof(zero));
     }
+    ::execvpe(sp.argv[0], argv, envp);
+    _fail(report);
 }
 
-process::process(process&& p)
-:   _pid(p._pid),
-    _running(p._running),
-    _exitcode(p._exitcode),
-    _stdin(p._stdin),
-    _stdout(p._stdout),
-    _stderr(p._stderr)
+void process::_fail(int report) noexcept
 {
-    // As a temporary object, we can assume that p came from current thread at which we 
-    // are now running this constructor (although it can be hacked by "std::move(p)" with 
-    // some p created from other thread). Then, we can also assume that no other threads 
-    // than current thread are now working (i.e, waiting) on p and *this.
-    //
-    // If we are to support move assignment, we have to deal with the case where target 
-    // of the assignment may have been shared with other threads, which may be accessing 
-    // _exitcode and other members when we update them in move assignment.
-    // See also: https://stackoverflow.com/a/46391077
+    const int error = errno;
+    ::write(report, &error, sizeof(error));
+    std::_Exit(127);  // instead of std::exit() due to no need for cleaning up.
+	// returning 127 as most shells do.
+}
+
+void process::_place(const _spawn& sp, int report) noexcept
+{
+    const _placement& pl = *sp.place;
+
+    // Moving into cgroup first, so that the limits of cgroup apply to what follows, as 
+    // writing "0" into cgroup.procs moves the writer.
+    if ( pl.procs != -1 && !sp.in_cgroup && ::write(pl.procs, "0", 1) == -1 )
+	_fail(report);
+
+    if ( pl.pgid != -1 && ::setpgid(0, pl.pgid) == -1 )
+	_fail(report);
+
+    if ( pl.has_cpus && ::sched_setaffinity(0, sizeof(pl.cpus), &pl.cpus) == -1 )
+	_fail(report);
 
-    if ( this != &p ) {  // to handle "process p { std::move(p) };".
-	p._pid	    = 0;
-	p._running  = DONE;
-	p._exitcode = UNKNOWN;
-	p._stdin    = DEVNULL;
-	p._stdout   = DEVNULL;
-	p._stderr   = DEVNULL;
+    constexpr int MPOL_BIND_ = 2;
+    if ( pl.has_mems && ::syscall(SYS_set_mempolicy, MPOL_BIND_, pl.mems,
+	sizeof(pl.mems) * 8 + 1) == -1 )  // maxnode is one more than bits in the mask.
+	_fail(report);
+
+    if ( pl.policy != -1 ) {
+	struct sched_param param {};
+	param.sched_priority = pl.priority;
+	if ( ::sched_setscheduler(0, pl.policy, &param) == -1 )
+	    _fail(report);
     }
-}
 
-/*
-class process {
-    ...
-protected:
-    const std::thread::id _tid = std::this_thread::get_id();
-    ...
-};
+    errno = 0;
+    if ( pl.nice != 0 && ::nice(pl.nice) == -1 && errno != 0 )
+	_fail(report);
 
-process::process(process&& p) { operator=(std::move(p)); }
+    constexpr int IOPRIO_WHO_PROCESS_ = 1;
+    if ( pl.ioprio != 0
+	&& ::syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS_, 0, pl.ioprio) == -1 )
+	_fail(report);
+}
 
-process& process::operator=(process&& p)
+void process::_cloexec_from(int lowfd) noexcept
 {
-    if ( this != &p ) {  // to handle "process p { std::move(p) }" or "p = std::move(p)".
-	if ( _tid != p._tid || _tid != std::this_thread::get_id() )
-	    throw std::runtime_error("cannot move process between threads");
+    // Without close_range(), we read /proc/self/fd with getdents64() directly, since 
+    // opendir() would allocate memory.
+    const int dirfd = ::open("/proc/self/fd", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if ( dirfd == -1 )
+	return;  // /proc is not mounted, so leaving fds as they are.
+
+    struct dirent64 {  // as defined in getdents64(2)
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+    };
+    alignas(dirent64) char buf[1024];
+    for ( long n ; (n = ::syscall(SYS_getdents64, dirfd, buf, sizeof(buf))) > 0 ; )
+	for ( long pos = 0 ; pos < n ; ) {
+	    const dirent64* const d = reinterpret_cast<const dirent64*>(buf + pos);
+	    pos += d->d_reclen;
+
+	    int fd = 0;
+	    for ( const char* p = d->d_name ; *p >= '0' && *p <= '9' ; ++p )
+		fd = fd * 10 + (*p - '0');
+	    if ( fd >= lowfd && fd != dirfd )  // "." and ".." are taken as 0.
+		::fcntl(fd, F_SETFD, FD_CLOEXEC);
+	}
 
-	std::unique_lock<std::mutex> lock(_mtx_running, std::try_to_lock);
-	if ( !lock || _running != DONE )
-	    throw std::runtime_error("cannot move process that is being shared");
+    ::close(dirfd);
+}
 
-	// However, we cannot still be sure that there are no threads that are accessing 
-	// this->_exitcode and other members while we update them below. Handling this 
-	// problem needs another mutex (and condition_variable) besides _mtx_running for 
-	// counting the number of threads that simultaneously access this object, which 
-	// is too expensive just for supporting move assignment.
+void process_handle::_take(process_handle& h)
+{
+    // As a temporary object, we can assume that h came from current thread at which we 
+    // are now running this (although it can be hacked by "std::move(h)" with some h 
+    // created from other thread). Then, we can also assume that no other threads than 
+    // current thread are now working (i.e, waiting) on h and *this. 
+    // See also: https://stackoverflow.com/a/46391077
 
-	std::swap(_pid, p._pid);
-	std::swap(_running, p._running);
-	std::swap(_exitcode, p._exitcode);
-	std::swap(_stdin, p._stdin);
-	std::swap(_stdout, p._stdout);
-	std::swap(_stderr, p._stderr);
+    if ( this == &h )  // to handle "process p { std::move(p) };".
+	return;
+
+    _pid	= h._pid;
+    _stdin	= h._stdin;
+    _stdout	= h._stdout;
+    _stderr	= h._stderr;
+    _pidfd	= h._pidfd.load();
+    _spawned	= h._spawned;
+
+    if ( _adopter* const adopter = h._settled_adopter() )
+	// Adopter may be publishing to h at this moment, so it copies _running and 
+	// _exitcode from h for us (and _adopted_by, which it may have cleared by now), and 
+	// publishes to us from now on.
+	adopter->_moved(h, *this);
+    else {
+	_adopted_by.store(nullptr, std::memory_order_relaxed);
+	_running  = h._running.load();
+	_exitcode = h._exitcode;
+	_killed	  = h._killed;
+	_take_usage(h);
     }
 
+    h._pid	= 0;
+    h._running	= DONE;
+    h._exitcode = UNKNOWN;
+    h._killed	= 0;
+    h._stdin	= -1;
+    h._stdout	= -1;
+    h._stderr	= -1;
+    h._pidfd	= -1;
+    h._adopted_by.store(nullptr, std::memory_order_relaxed);
+}
+
+process_handle& process_handle::operator=(process_handle&& h)
+{
+    if ( this != &h ) {  // to handle "p = std::move(p);".
+	_release();  // as if destroyed, but leaving child process running (if not done).
+	_take(h);
+    }
     return *this;
 }
-*/
 
-process::~process()
+void process_handle::_release()
 {
     // We do not check for each fd == -1 before ::close()ing; because ::close() will do 
     // no harm for -1, and even if fd != -1, fd might be already closed from explicitly 
     // closing a fdstream that shares the fd.
 
+    if ( _adopter* const adopter = _settled_adopter() )
+	adopter->_forget(*this);  // which does nothing if it has just released us.
+
+    instrument::_unwatch(_stdout);
     ::close(_stdin);
     ::close(_stdout);
     ::close(_stderr);
+    ::close(_pidfd);  // may be -1 or NO_PIDFD, which will do no harm either.
 }
 
-void process::wait()
+process_handle::_adopter* process_handle::_settled_adopter()
 {
-    std::unique_lock<std::mutex> lock(_mtx_running);
-    _not_awaited.wait(lock, [this]{ return _running != AWAITED; });
-
-    if ( _running == ALONE ) {
-	_running = AWAITED;  // For the importance of AWAITED, see comment in poll().
-	lock.unlock();  // no need to notify of AWAITED since nobody will wait for it.
+    _adopter* const adopter = _adopted_by.load(std::memory_order_acquire);
+    if ( !adopter )
+	// An adopter clears _adopted_by right before publishing DONE (or ALONE), since we 
+	// may be gone right after that. So, AWAITED without adopter means it is in between 
+	// (as nobody else waits for us while moved or destroyed), which we wait out.
+	for ( int running ; ((running = _running.load(std::memory_order_acquire))
+	    & ~SLEEPING) == AWAITED ; )
+	    _sleep(running, nullptr);
+    return adopter;
+}
 
-	int status;
-	int wpid = ::waitpid(pid, &status, 0);
-
-	lock.lock();
-	if ( wpid != -1 ) {
-	    if ( WIFEXITED(status) )
-		_exitcode = WEXITSTATUS(status);
-	    else if ( WIFSIGNALED(status) )
-		_exitcode = -WTERMSIG(status);
+bool process_handle::_await()
+{
+    int running = _running.load(std::memory_order_acquire);
+    for ( ;; )
+	if ( running == ALONE ) {
+	    if ( _running.compare_exchange_weak(running, AWAITED,
+		std::memory_order_acquire) )
+		return true;
 	}
-	//else: Possibly, SIGCHLD's signal action is set to SIG_IGN explicitly.
+	else if ( (running & ~SLEEPING) == POLLING ) {
+	    _sleep(running, nullptr);  // which will not be long.
+	    running = _running.load(std::memory_order_acquire);
+	}
+	else
+	    return false;
+}
+
+void process_handle::_sleep(int running, const timespec* timeout)
+{
+    if ( (running & ~SLEEPING) < AWAITED )
+	return;  // not running any longer
+    if ( !(running & SLEEPING) && !_running.compare_exchange_strong(running,
+	running | SLEEPING, std::memory_order_relaxed) )
+	return;  // changed already
+
+    static_assert(sizeof(_running) == sizeof(int), "futex needs a plain int");
+    ::syscall(SYS_futex, reinterpret_cast<int*>(&_running), FUTEX_WAIT_PRIVATE,
+	running | SLEEPING, timeout, nullptr, 0);
+	// returns as soon as _running changes from (running | SLEEPING), or immediately 
+	// if changed already. Spurious wake-ups (or EINTR) are checked by the callers.
+}
+
+void process_handle::_publish(int running)
+{
+    if ( _running.exchange(running, std::memory_order_release) & SLEEPING )
+	::syscall(SYS_futex, reinterpret_cast<int*>(&_running), FUTEX_WAKE_PRIVATE,
+	    INT_MAX, nullptr, nullptr, 0);
+	// wakes up all since everybody wants DONE, and any of them may take over ALONE.
+}
 
-	_running = DONE;
-	_not_awaited.notify_all();
+void process_handle::wait()
+{
+    while ( !_await() ) {
+	const int running = _running.load(std::memory_order_acquire);
+	if ( running == DONE )
+	    return;
+	_sleep(running, nullptr);
     }
+    // For the importance of AWAITED, see comment in poll().
+
+    int status;
+    struct rusage ru;
+    int wpid = ::wait4(_pid, &status, 0, &ru);
+
+    if ( wpid != -1 )
+	_reaped(status, ru);
+    //else: Possibly, SIGCHLD's signal action is set to SIG_IGN explicitly.
+
+    _publish(DONE);
 }
 
-bool process::wait(const std::chrono::milliseconds& timeout)
+bool process_handle::wait(const std::chrono::milliseconds& timeout)
 {
     const auto when = std::chrono::steady_clock::now() + timeout;
 
-    std::unique_lock<std::mutex> lock(_mtx_running);
-    if ( !_not_awaited.wait_for(lock, timeout, [this]{ return _running != AWAITED; }) )
-	return false;  // someone is still waiting after timed out.
+    while ( !_await() ) {
+	const int running = _running.load(std::memory_order_acquire);
+	if ( running == DONE )
+	    return true;
 
-    if ( _running == ALONE ) {
-	_running = AWAITED;
-	lock.unlock();  // keeping critical section as small as possible
+	const auto remaining =
+	    std::chrono::duration_cast<std::chrono::nanoseconds>(
+		when - std::chrono::steady_clock::now() ).count();
+	if ( remaining <= 0 )
+	    return false;  // someone is still waiting after timed out.
 
-	using namespace std::chrono_literals;
-	int status, wpid;
+	const timespec ts = { static_cast<time_t>(remaining / 1000000000),
+	    static_cast<long>(remaining % 1000000000) };
+	_sleep(running, &ts);
+    }
 
-	for ( auto dt = 1ms ; (wpid = ::waitpid(pid, &status, WNOHANG)) == 0 ; )
-	// We cannot use here do ... while() for for() because we have to check 
-	// ::waitpid() at least once however short the timeout is specified.
-	{
-	    const auto remaining =
-		std::chrono::duration_cast<std::chrono::milliseconds>(
-		    when - std::chrono::steady_clock::now() );
-	    if ( remaining <= 0ms ) {
-		// "I have no more time to wait. So, someone else wait instead please!"
-		_running = ALONE;
-		_not_awaited.notify_one();
-		    // notify_one() is enough since everybody is willing to wait.
-		return false;
-	    }
+    using namespace std::chrono_literals;
+    int status, wpid;
+    struct rusage ru;
+    struct pollfd pfd = { _open_pidfd(), POLLIN, 0 };
 
-	    std::this_thread::sleep_for(std::min(dt, remaining));
-	    if ( dt < 64ms ) dt *= 2;  // wait for maximum 64ms at a time
+    for ( auto dt = 1ms ; (wpid = ::wait4(_pid, &status, WNOHANG, &ru)) == 0 ; )
+    // We cannot use here do ... while() for for() because we have to check ::waitpid() 
+    // at least once however short the timeout is specified.
+    {
+	const auto remaining = std::chrono::ceil<std::chrono::milliseconds>(
+	    when - std::chrono::steady_clock::now() );
+	    // rounded up, not to give up early nor to spin with poll() of 0ms.
+	if ( remaining <= 0ms ) {
+	    // "I have no more time to wait. So, someone else wait instead please!"
+	    _publish(ALONE);
+	    return false;
 	}
 
-	lock.lock();
-	if ( wpid != -1 ) {
-	    if ( WIFEXITED(status) )
-		_exitcode = WEXITSTATUS(status);
-	    else if ( WIFSIGNALED(status) )
-		_exitcode = -WTERMSIG(status);
+	if ( pfd.fd >= 0 )
+	    ::poll(&pfd, 1, remaining.count());
+	    // will return as soon as child terminates, or -1 on EINTR, either of which is 
+	    // checked by ::waitpid() again.
+	else {
+	    std::this_thread::sleep_for(std::min(dt, remaining));
+	    if ( dt < 64ms ) dt *= 2;  // wait for maximum 64ms at a time
 	}
-	//else: Possibly, SIGCHLD's signal action is set to SIG_IGN explicitly.
-
-	_running = DONE;
-	_not_awaited.notify_all();  // notify_all() since everybody wants it.
     }
 
+    if ( wpid != -1 )
+	_reaped(status, ru);
+    //else: Possibly, SIGCHLD's signal action is set to SIG_IGN explicitly.
+
+    _publish(DONE);  // waking up everybody since everybody wants it.
     return true;
 }
 
-bool process::poll()
+bool process_handle::poll()
 {
-    std::lock_guard<std::mutex> lock(_mtx_running);
+    int running = _running.load(std::memory_order_acquire);
 
-    if ( _running == ALONE ) {
+    if ( running == ALONE && _running.compare_exchange_strong(running, POLLING,
+	std::memory_order_acquire) ) {
 	int status;
-	int wpid = ::waitpid(pid, &status, WNOHANG);
-	    // We do not release mutex here since ::waitpid() returns immediately. 
-	    // Otherwise, we should do "_running = AWAITED" before releasing mutex so 
-	    // that other threads cannot run ::waitpid() until we set back "_running = 
-	    // ALONE" though they can still acquire mutex. (If there are two calls of 
-	    // ::waitpid() and the first call happens to succeed, the second call will 
-	    // result in ECHILD, which means child process has been released and the 
-	    // parent has no child with the old child pid.) In this regard, we can think 
-	    // of "_running = AWAITED" as a soft kind of mutex.
-
-	if ( wpid == 0 ) return false;
-	if ( wpid != -1 ) {
-	    if ( WIFEXITED(status) )
-		_exitcode = WEXITSTATUS(status);
-	    else if ( WIFSIGNALED(status) )
-		_exitcode = -WTERMSIG(status);
+	struct rusage ru;
+	int wpid = ::wait4(_pid, &status, WNOHANG, &ru);
+	    // We have to set "_running = POLLING" before ::waitpid() so that other threads 
+	    // cannot run ::waitpid() until we set back "_running = ALONE". (If there are 
+	    // two calls of ::waitpid() and the first call happens to succeed, the second 
+	    // call will result in ECHILD, which means child process has been released and 
+	    // the parent has no child with the old child pid.) In this regard, we can think 
+	    // of "_running = AWAITED" (or POLLING) as a soft kind of mutex. Other threads 
+	    // in poll() meanwhile just return false, and those in wait() sleep until we 
+	    // finish, which will be soon since ::waitpid() returns immediately.
+
+	if ( wpid == 0 ) {
+	    _publish(ALONE);
+	    return false;
 	}
+	if ( wpid != -1 )
+	    _reaped(status, ru);
 	//else: Possibly, SIGCHLD's signal action is set to SIG_IGN explicitly.
 
-	_running = DONE;
-	_not_awaited.notify_all();
+	_publish(DONE);
+	return true;
+    }
+
+    return running == DONE;
+}
+
+int process_handle::_exitcode_of(int status)
+{
+    if ( WIFEXITED(status) )
+	return WEXITSTATUS(status);
+    else if ( WIFSIGNALED(status) )
+	return -WTERMSIG(status);
+    else
+	return UNKNOWN;
+}
+
+void process_handle::_reaped(int status, const struct rusage& ru)
+{
+    using namespace std::chrono;
+    const auto us = [](const timeval& tv)
+	{ return seconds(tv.tv_sec) + microseconds(tv.tv_usec); };
+
+    _exitcode = _exitcode_of(status);
+    instrument::_record(instrument::EXIT, _spawned);
+
+    if ( !_usage ) {
+	// This may be in an adopter thread, which should not throw, so usage is just 
+	// left all 0 if out of memory.
+	_usage = new (std::nothrow) resource_usage;
+	_owns_usage = _usage != nullptr;
+	if ( !_usage )
+	    return;
     }
+    _usage->user    = us(ru.ru_utime);
+    _usage->system  = us(ru.ru_stime);
+    _usage->maxrss  = ru.ru_maxrss;
+    _usage->majflt  = ru.ru_majflt;
+    _usage->nvcsw   = ru.ru_nvcsw;
+    _usage->nivcsw  = ru.ru_nivcsw;
+    _usage->runtime = duration_cast<microseconds>(steady_clock::now() - _spawned);
+}
 
-    return _running == DONE;
+void process_handle::_take_usage(process_handle& h)
+{
+    if ( h._owns_usage && !_usage ) {
+	_usage = h._usage;
+	_owns_usage = true;
+	h._usage = nullptr;
+	h._owns_usage = false;
+	return;
+    }
+
+    // Otherwise we copy it, allocating ours only if there is anything to copy (i.e, h 
+    // has terminated), so that moving child process still running costs no allocation.
+    resource_usage* const from = h._usage;
+    if ( !_usage && from && from->runtime.count() != 0 ) {
+	_usage = new (std::nothrow) resource_usage;  // or left all 0 as in _reaped()
+	_owns_usage = _usage != nullptr;
+    }
+    if ( _usage )
+	*_usage = from ? *from : resource_usage {};
+    if ( from )
+	*from = {};
 }
 
-void process::kill(int sig)
+int process_handle::_open_pidfd()
+{
+    int fd = _pidfd.load();
+    if ( fd == -1 ) {
+#ifdef SYS_pidfd_open
+	fd = ::syscall(SYS_pidfd_open, _pid, 0);
+	if ( fd == -1 && errno != ENOSYS )
+	    return -1;  // Possibly, out of fds. We will try again next time.
+	if ( fd == -1 )
+#endif
+	    fd = NO_PIDFD;
+
+	// Another thread may have opened it simultaneously, in which case we take the one 
+	// that won.
+	int expected = -1;
+	if ( !_pidfd.compare_exchange_strong(expected, fd) ) {
+	    if ( fd >= 0 )
+		::close(fd);
+	    fd = expected;
+	}
+    }
+
+    return fd < 0 ? -1 : fd;
+}
+
+void process_handle::kill(int sig)
 {
     if ( !poll() )
 	// We use !poll() instead of "_running != DONE" to be able to kill otherwise 
 	// possibly defunct child process. (A defunct (zombie) child process that 
 	// terminated but has not been waited for can be killed only by ::waitpid(), not 
 	// ::kill().)
-	if ( ::kill(pid, sig) == -1 )
+	if ( ::kill(_pid, sig) == -1 )
 	    throw std::system_error(errno, std::system_category());
 }
 
 
+bool process::_communicate(std::string_view input, std::string& out, std::string& err,
+    const std::chrono::steady_clock::time_point* when)
+{
+    // Writing into stdin that child process has closed will raise SIGPIPE, which would 
+    // kill us. So, we block SIGPIPE here and take it out if raised (by EPIPE).
+    sigset_t sigpipe, oldmask, pending;
+    ::sigemptyset(&sigpipe);
+    ::sigaddset(&sigpipe, SIGPIPE);
+    ::pthread_sigmask(SIG_BLOCK, &sigpipe, &oldmask);
+    ::sigpending(&pending);
+    const bool was_pending = ::sigismember(&pending, SIGPIPE);
+    bool epipe = false;
+
+    if ( input.empty() ) {
+	::close(_stdin);
+	_stdin = DEVNULL;
+    }
+
+    struct pollfd pfds[3] = {
+	{ _stdin, POLLOUT, 0 }, { _stdout, POLLIN, 0 }, { _stderr, POLLIN, 0 } };
+    std::string* const outputs[3] = { nullptr, &out, &err };
+    int flags[3];
+    for ( int i = 0 ; i < 3 ; ++i )
+	if ( pfds[i].fd >= 0 ) {
+	    flags[i] = ::fcntl(pfds[i].fd, F_GETFL);
+	    ::fcntl(pfds[i].fd, F_SETFL, flags[i] | O_NONBLOCK);
+	}
+
+    bool timed_out = false;
+    size_t written = 0;
+    while ( pfds[0].fd >= 0 || pfds[1].fd >= 0 || pfds[2].fd >= 0 ) {
+	int timeout = -1;
+	if ( when ) {
+	    const auto remaining =
+		std::chrono::ceil<std::chrono::milliseconds>(
+		    *when - std::chrono::steady_clock::now() );
+	    timeout = std::max(0, static_cast<int>(remaining.count()));
+	}
+
+	const int n = ::poll(pfds, 3, timeout);
+	if ( n == 0 ) {
+	    timed_out = true;
+	    break;
+	}
+	if ( n == -1 ) {
+	    if ( errno == EINTR )
+		continue;
+	    break;  // cannot happen unless out of memory.
+	}
+
+	if ( pfds[0].revents ) {
+	    const ssize_t k =
+		::write(pfds[0].fd, input.data() + written, input.size() - written);
+	    if ( k > 0 )
+		written += k;
+	    else if ( k == -1 && errno == EPIPE )
+		epipe = true;  // Child will not read any more, which is not an error.
+
+	    if ( written == input.size() || (k == -1 && errno != EAGAIN && errno != EINTR) ) {
+		::close(_stdin);  // to let child see EOF.
+		_stdin = DEVNULL;
+		pfds[0].fd = -1;
+	    }
+	}
+
+	for ( int i = 1 ; i < 3 ; ++i )
+	    if ( pfds[i].revents ) {
+		const ssize_t k = _read_some(pfds[i].fd, *outputs[i]);
+		if ( k == 0 || (k == -1 && errno != EAGAIN && errno != EINTR) ) {
+		    ::fcntl(pfds[i].fd, F_SETFL, flags[i]);  // restore blocking mode.
+		    pfds[i].fd = -1;  // EOF
+		}
+	    }
+    }
+
+    for ( int i = 0 ; i < 3 ; ++i )
+	if ( pfds[i].fd >= 0 )
+	    ::fcntl(pfds[i].fd, F_SETFL, flags[i]);
+
+    if ( epipe && !was_pending ) {
+	const struct timespec zero = {};
+	::sigtimedwait(&sigpipe, nullptr, &zero);
+    }
+    ::pthread_sigmask(SIG_SETMASK, &oldmask, nullptr);
+
+    if ( timed_out )
+	return false;
+    if ( !when ) {
+	wait();
+	return true;
+    }
+    return wait(std::max(std::chrono::milliseconds(0),
+	std::chrono::duration_cast<std::chrono::milliseconds>(
+	    *when - std::chrono::steady_clock::now() )));
+}
+
+ssize_t process::_read_some(int fd, std::string& s)
+{
+    // We read directly into s (by as much as available in the pipe, or 64KB at least 
+    // unless s has some capacity left), instead of reading into an intermediate buffer 
+    // and then copying it into s. The capacity of s grows geometrically, while 
+    // s.resize() fills only what we read into.
+    const size_t size = s.size();
+    const size_t spare = s.capacity() - size;
+    const size_t room = std::max(_readable(fd),
+	spare > 0 ? std::min<size_t>(spare, 64 * 1024) : 64 * 1024);
+    if ( spare < room )
+	s.reserve(std::max(s.capacity() * 2, size + room));
+    s.resize(size + room);
+
+    const ssize_t n = ::read(fd, &s[size], room);
+    s.resize(size + std::max<ssize_t>(n, 0));
+    instrument::_read(fd, n);
+    return n;
+}
+
+size_t process::_readable(int fd)
+{
+    int n = 0;
+    return ::ioctl(fd, FIONREAD, &n) == -1 || n < 0 ? 0 : n;
+}
+
+size_t process::read_all(int fd, std::string& s, size_t hint)
+{
+    struct stat st;
+    if ( ::fstat(fd, &st) == 0 && S_ISREG(st.st_mode) ) {
+	const off_t offset = ::lseek(fd, 0, SEEK_CUR);
+	if ( offset != -1 && st.st_size > offset )
+	    hint = std::max<size_t>(hint, st.st_size - offset);
+    }
+    if ( hint > 0 )
+	s.reserve(s.size() + hint + 1);  // +1 to see EOF without growing.
+
+    const size_t size = s.size();
+    for ( ;; ) {
+	const ssize_t n = _read_some(fd, s);
+	if ( n == 0 )
+	    break;
+	if ( n == -1 ) {
+	    if ( errno == EAGAIN ) {  // in case fd is O_NONBLOCK
+		struct pollfd pfd = { fd, POLLIN, 0 };
+		::poll(&pfd, 1, -1);
+	    }
+	    else if ( errno != EINTR )
+		throw std::system_error(errno, std::system_category());
+	}
+    }
+
+    return s.size() - size;
+}
+
+
 
 template <typename CharT, typename Traits, typename Allocator>
 std::vector<const CharT*> process::_to_vector(
     std::initializer_list<std::basic_string<CharT, Traits, Allocator>> args)
 {
     std::vector<const CharT*> result;
+    result.reserve(args.size() + 1);
     for ( const auto& each: args )
 	result.push_back(each.c_str());
     result.push_back(nullptr);
-    result.shrink_to_fit();
-    return std::move(result);
+    return result;  // not std::move(result) so as not to prevent copy elision.
 }
 
 extern "C" {
-#include <fcntl.h>  // open(), O_RDWR
+#include <fcntl.h>  // open(), O_RDWR, faccessat(), AT_FDCWD, AT_EACCESS
+}
+
+template <typename>
+bool process::_resolve(const char* file, char (&path)[PATH_MAX])
+{
+    if ( !*file || std::strchr(file, '/') )
+	return false;  // execvp() does not search $PATH for it either.
+
+    const char* env = ::getenv("PATH");
+    if ( !env )
+	env = "/bin:/usr/bin";  // as execvp() of glibc does
+
+    {
+	std::shared_lock<std::shared_mutex> lock(_paths.mtx);
+	if ( _paths.env == env ) {  // Otherwise, $PATH has changed since cached.
+	    const auto it = _paths.paths.find(file);
+	    if ( it != _paths.paths.end() ) {
+		std::memcpy(path, it->second.c_str(), it->second.size() + 1);
+		return true;
+	    }
+	}
+    }
+
+    const size_t len = std::strlen(file);
+    for ( const char* dir = env ; ; dir++ ) {
+	const char* const end = ::strchrnul(dir, ':');
+	if ( *dir != '/' )
+	    return false;  // relative to cwd (e.g, "" or "."), so left to execvp().
+
+	const size_t n = end - dir;
+	if ( n + 1 + len < PATH_MAX ) {
+	    std::memcpy(path, dir, n);
+	    path[n] = '/';
+	    std::memcpy(path + n + 1, file, len + 1);
+
+	    struct stat st;
+	    if ( ::stat(path, &st) == 0 && S_ISREG(st.st_mode)
+		&& ::faccessat(AT_FDCWD, path, X_OK, AT_EACCESS) == 0 )
+		break;
+	}
+
+	if ( !*(dir = end) )
+	    return false;  // not found, which execvp() will report the same in child.
+    }
+
+    std::unique_lock<std::shared_mutex> lock(_paths.mtx);
+    if ( _paths.env != env ) {
+	_paths.paths.clear();
+	_paths.env = env;
+    }
+    _paths.paths.emplace(file, path);
+    return true;
+}
+
+void process::_unresolve(const char* file)
+{
+    std::unique_lock<std::shared_mutex> lock(_paths.mtx);
+    const auto it = _paths.paths.find(file);
+    if ( it != _paths.paths.end() )
+	_paths.paths.erase(it);
 }
 
 template <typename>
@@ -0,0 +1,310 @@
+// process_group: container of processes that can wait for any or all of them at once
+//
+// - process_group::emplace_back(...) creates a process in place with the same arguments 
+//   as process constructors, and returns a reference to it, which stays valid until the 
+//   process_group is destroyed. (An existing process can also be moved into it with 
+//   emplace_back(std::move(p)).)
+// - process_group::wait_any() waits for any of the processes to terminate, and returns 
+//   the process terminated, which has not been returned before. It returns nullptr if 
+//   timed out or if there are no more processes to return.
+// - process_group::wait_all() waits for all of the processes to terminate.
+// - process_group::finished() returns the processes terminated so far, in order of 
+//   their termination (as far as the process_group has noticed).
+// - process_group::erase(p) removes p from process_group, destroying p.
+// - process_group::usage() returns the resources used by the processes terminated so 
+//   far, added up (see resource_usage in process.hpp).
+// - process_group::interrupt() makes wait_any() blocked in other thread (or the next 
+//   wait_any() to be called) return nullptr right away, while wait_all() is not 
+//   interrupted. It is the only member function of process_group that can be called 
+//   from other threads.
+//
+// process_group puts pidfds of all processes in one epoll set, so waiting for any of 
+// hundreds of processes costs the same as waiting for a single process. (On older 
+// kernels without pidfd, it falls back to polling each process with short sleeps.)
+//
+// Note all processes in process_group can still be waited for (or adopted by reaper) 
+// individually as usual, and process_group just notices when they terminate.
+
+
+
+#pragma once
+
+#include "process.hpp"
+// <algorithm>: min(), max()
+// <chrono>: chrono::steady_clock::now(), chrono_literals, chrono::milliseconds, 
+//   chrono::ceil<>
+// <system_error>: system_error(), system_category(), errno
+// <thread>: this_thread::sleep_for()
+
+#include <list>  // list<>, .emplace_back(), .begin(), .end(), .erase()
+#include <vector>  // vector<>, .push_back(), .erase()
+
+extern "C" {
+#include <sys/epoll.h>  // epoll_create1(), epoll_ctl(), epoll_wait()
+#include <sys/eventfd.h>  // eventfd()
+}
+
+
+
+class process_group {
+private:
+    std::list<process> _procs;  // list<> not to move processes on growing or erasing.
+    std::vector<process*> _finished;  // in order of termination
+    size_t _returned = 0;  // number of _finished returned by wait_any()
+    std::vector<process*> _unwatched;  // running _procs that epoll cannot watch
+
+    const int _epfd;  // epoll set of pidfds of running _procs, and _wakeup
+    const int _wakeup;  // eventfd for interrupt()
+
+    // move processes terminated to _finished, waiting for as long as timeout (or 
+    // indefinitely if timeout < 0ms) until any of them terminates, or returning false if 
+    // interrupted.
+    bool _poll(std::chrono::milliseconds timeout);
+
+public:
+    process_group();
+    ~process_group() { ::close(_epfd); ::close(_wakeup); }
+    // Child processes are not killed nor waited for when process_group is destroyed, 
+    // just like processes are not.
+
+    // process_group is not copyable nor movable.
+    process_group(const process_group&) =delete;
+    process_group& operator=(const process_group&) =delete;
+
+    template <typename... Args>
+    process& emplace_back(Args&&... args);
+
+    template <typename... Args>
+    process& emplace_back(std::initializer_list<std::string> args, Args&&... rest)
+    { return emplace_back(process { args, std::forward<Args>(rest)... }); }
+
+    template <typename... Args>
+    process& emplace_back(int fd0, std::initializer_list<std::string> args,
+	Args&&... rest)
+    { return emplace_back(process { fd0, args, std::forward<Args>(rest)... }); }
+
+    size_t size() const { return _procs.size(); }
+    size_t running() const { return _procs.size() - _finished.size(); }
+
+    std::list<process>::iterator begin() { return _procs.begin(); }
+    std::list<process>::iterator end() { return _procs.end(); }
+
+    const std::vector<process*>& finished() const { return _finished; }
+
+    // resources used by the processes terminated so far, added up
+    resource_usage usage() const;
+
+    // remove p from process_group. (p should be terminated, otherwise it will become a 
+    // defunct process unless adopted by reaper.)
+    void erase(process& p);
+
+    // interrupt wait_any() (from other thread).
+    void interrupt();
+
+    // wait for any process to terminate indefinitely, returning the process (that has 
+    // not been returned by wait_any() yet), or nullptr if nothing to return (or if 
+    // interrupted).
+    process* wait_any();
+
+    // wait for any process to terminate for the duration of timeout, returning the 
+    // process, or nullptr if timed out (or nothing to return, or interrupted).
+    process* wait_any(const std::chrono::milliseconds& timeout);
+
+    // wait for all processes to terminate indefinitely.
+    void wait_all();
+
+    // wait for all processes to terminate for the duration of timeout, returning true if 
+    // all terminated, or false if timed out.
+    bool wait_all(const std::chrono::milliseconds& timeout);
+};
+
+process_group::process_group()
+:   _epfd { ::epoll_create1(EPOLL_CLOEXEC) },
+    _wakeup { ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK) }
+{
+    if ( _epfd == -1 || _wakeup == -1 ) {
+	const int error = errno;
+	::close(_epfd);
+	::close(_wakeup);
+	throw std::system_error(error, std::system_category());
+    }
+
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.ptr = nullptr;  // for _wakeup
+    ::epoll_ctl(_epfd, EPOLL_CTL_ADD, _wakeup, &ev);
+}
+
+template <typename... Args>
+process& process_group::emplace_back(Args&&... args)
+{
+    process& p = _procs.emplace_back(std::forward<Args>(args)...);
+
+    if ( p.pid == 0 || p.poll() )  // moved-from or already terminated
+	_finished.push_back(&p);
+
+    else {
+	struct epoll_event ev = {};
+	ev.events = EPOLLIN;
+	ev.data.ptr = &p;
+
+	const int pidfd = p._open_pidfd();
+	if ( pidfd == -1 || ::epoll_ctl(_epfd, EPOLL_CTL_ADD, pidfd, &ev) == -1 )
+	    _unwatched.push_back(&p);
+    }
+
+    return p;
+}
+
+void process_group::erase(process& p)
+{
+    for ( auto it = _finished.begin() ; it != _finished.end() ; ++it )
+	if ( *it == &p ) {
+	    if ( it - _finished.begin() < static_cast<ptrdiff_t>(_returned) )
+		--_returned;
+	    _finished.erase(it);
+	    break;
+	}
+
+    for ( auto it = _unwatched.begin() ; it != _unwatched.end() ; ++it )
+	if ( *it == &p ) {
+	    _unwatched.erase(it);
+	    break;
+	}
+
+    for ( auto it = _procs.begin() ; it != _procs.end() ; ++it )
+	if ( &*it == &p ) {
+	    _procs.erase(it);  // will remove pidfd of p from _epfd as well.
+	    break;
+	}
+}
+
+resource_usage process_group::usage() const
+{
+    resource_usage total;
+    for ( const process* p: _finished )
+	total += p->usage;
+    return total;
+}
+
+void process_group::interrupt()
+{
+    const uint64_t one = 1;
+    ::write(_wakeup, &one, sizeof(one));
+}
+
+bool process_group::_poll(std::chrono::milliseconds timeout)
+{
+    using namespace std::chrono_literals;
+
+    if ( !_unwatched.empty() && (timeout < 0ms || timeout > 64ms) )
+	timeout = 64ms;  // to poll _unwatched again at least this often.
+
+    bool interrupted = false;
+
+    struct epoll_event events[64];
+    const int n = ::epoll_wait(_epfd, events, 64, timeout.count());
+
+    for ( int i = 0 ; i < n ; ++i ) {
+	if ( events[i].data.ptr == nullptr ) {
+	    uint64_t count;
+	    ::read(_wakeup, &count, sizeof(count));
+	    interrupted = true;
+	    continue;
+	}
+
+	process& p = *static_cast<process*>(events[i].data.ptr);
+	::epoll_ctl(_epfd, EPOLL_CTL_DEL, p._pidfd, nullptr);
+
+	p.wait();
+	    // will return without blocking since child has terminated already, or will 
+	    // block briefly if other thread (or reaper) is reaping it right now.
+	_finished.push_back(&p);
+    }
+
+    for ( auto it = _unwatched.begin() ; it != _unwatched.end() ; )
+	if ( (*it)->poll() ) {
+	    _finished.push_back(*it);
+	    it = _unwatched.erase(it);
+	}
+	else
+	    ++it;
+
+    return !interrupted;
+}
+
+process* process_group::wait_any()
+{
+    using namespace std::chrono_literals;
+
+    while ( _returned == _finished.size() && running() > 0 )
+	if ( !_poll(-1ms) )
+	    break;
+
+    return _returned < _finished.size() ? _finished[_returned++] : nullptr;
+}
+
+process* process_group::wait_any(const std::chrono::milliseconds& timeout)
+{
+    using namespace std::chrono_literals;
+    const auto when = std::chrono::steady_clock::now() + timeout;
+
+    // We have to poll at least once however short the timeout is specified.
+    bool polled = false;
+    for ( auto dt = 1ms ; ; polled = true ) {
+	if ( _returned < _finished.size() || running() == 0 )
+	    break;
+
+	// rounded up, not to spin with _poll(0ms) in the last sub-millisecond
+	const auto remaining = std::max(0ms,
+	    std::chrono::ceil<std::chrono::milliseconds>(
+		when - std::chrono::steady_clock::now() ));
+	if ( remaining == 0ms && polled )
+	    break;
+
+	if ( _unwatched.empty() ) {
+	    if ( !_poll(remaining) )
+		break;
+	}
+	else {
+	    if ( !_poll(std::min(dt, remaining)) )
+		break;
+	    if ( dt < 64ms ) dt *= 2;  // poll for maximum 64ms at a time
+	}
+    }
+
+    return _returned < _finished.size() ? _finished[_returned++] : nullptr;
+}
+
+void process_group::wait_all()
+{
+    using namespace std::chrono_literals;
+
+    while ( running() > 0 )
+	_poll(-1ms);
+}
+
+bool process_group::wait_all(const std::chrono::milliseconds& timeout)
+{
+    using namespace std::chrono_literals;
+    const auto when = std::chrono::steady_clock::now() + timeout;
+
+    bool polled = false;
+    for ( auto dt = 1ms ; running() > 0 ; polled = true ) {
+	// rounded up, not to spin with _poll(0ms) in the last sub-millisecond
+	const auto remaining = std::max(0ms,
+	    std::chrono::ceil<std::chrono::milliseconds>(
+		when - std::chrono::steady_clock::now() ));
+	if ( remaining == 0ms && polled )
+	    return false;
+
+	if ( _unwatched.empty() )
+	    _poll(remaining);
+	else {
+	    _poll(std::min(dt, remaining));
+	    if ( dt < 64ms ) dt *= 2;
+	}
+    }
+
+    return true;
+}
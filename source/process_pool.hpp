@@ -0,0 +1,312 @@
+// process_pool: runs a queue of commands with at most N of them running at a time
+//
+// - process_pool pool { N } creates a pool running at most N commands at a time.
+// - pool.submit(argv) queues a command, and returns a future<> of a process_pool::result 
+//   that will be available when the command terminates. Or, pool.submit(argv, callback) 
+//   will call callback(result) instead when the command terminates. (Callbacks are 
+//   called from the dispatcher thread of process_pool, and hence should return quickly 
+//   not to delay launching next commands. An exception thrown from a callback is 
+//   ignored, not to bring the dispatcher down.)
+// - If capture is true, the stdout and stderr of the command are captured into result.
+// - pool.wait() waits until all commands submitted so far are done.
+// - ~process_pool() waits for all commands submitted to be done as well.
+//
+// A single dispatcher thread launches next command as soon as any of the running 
+// commands terminates, using process_group::wait_any(). Captured outputs are written to 
+// (unlinked) temporary files instead of pipes, so that a command producing a large 
+// output never blocks on a full pipe while the dispatcher is waiting.
+//
+// If slots is given, the commands running in each slot i (0 <= i < N) of process_pool 
+// are spawned with slots[i % slots.size()] (of process::options), e.g, to spread slots 
+// across NUMA nodes with cpus and mems of each node. Or, if cpus is given, each slot i is 
+// pinned to cpus[i % cpus.size()].
+
+
+
+#pragma once
+
+#include "process_group.hpp"
+// <mutex>: mutex, lock_guard<>, unique_lock<>
+// <string>: string
+// <system_error>: system_error(), system_category(), errno
+// <thread>: thread
+// <vector>: vector<>
+
+#include <condition_variable>  // condition_variable
+#include <cstdlib>  // getenv()
+#include <deque>  // deque<>
+#include <exception>  // exception
+#include <functional>  // function<>
+#include <future>  // future<>, promise<>
+#include <memory>  // make_shared<>
+#include <new>  // bad_alloc
+#include <type_traits>  // enable_if_t<>, is_same<>
+#include <utility>  // move()
+
+extern "C" {
+#include <fcntl.h>  // open(), O_TMPFILE
+#include <unistd.h>  // pread(), unlink()
+}
+
+
+
+class process_pool {
+public:
+    struct result {
+	int exitcode = process::UNKNOWN;
+	int error = 0;	// errno if the command could not be launched, or 0
+	resource_usage usage;  // of the command
+	std::string out;  // stdout and stderr captured (if capture is true)
+	std::string err;
+    };
+
+    explicit process_pool(size_t concurrency, std::vector<process::options> slots = {});
+    process_pool(size_t concurrency, const std::vector<int>& cpus);
+    ~process_pool();
+
+    // process_pool is not copyable nor movable.
+    process_pool(const process_pool&) =delete;
+    process_pool& operator=(const process_pool&) =delete;
+
+    std::future<result> submit(std::vector<std::string> argv)
+    { return submit(std::move(argv), false); }
+
+    // capture is a bool itself, not anything convertible to bool (e.g, a lambda without 
+    // capture, which is rather a callback to be passed to submit() below).
+    template <typename Bool,
+	typename =std::enable_if_t<std::is_same<Bool, bool>::value>>
+    std::future<result> submit(std::vector<std::string> argv, Bool capture);
+
+    void submit(std::vector<std::string> argv, std::function<void(result&&)> callback,
+	bool capture =false);
+
+    // wait until all commands submitted are done.
+    void wait();
+
+private:
+    struct _job {
+	std::vector<std::string> argv;
+	std::function<void(result&&)> callback;
+	bool capture;
+    };
+
+    struct _slot {
+	process* p = nullptr;  // process running in this slot, or nullptr if free
+	_job job;
+	int out = -1, err = -1;  // temporary files for capturing, or -1
+    };
+
+    const size_t _concurrency;
+    const std::vector<process::options> _slots;
+
+    std::mutex _mtx;  // mutex protecting _jobs, _pending, and _stopping
+    std::condition_variable _cv;  // waiter for new jobs (or for _pending == 0)
+    std::deque<_job> _jobs;  // jobs not launched yet
+    size_t _pending = 0;  // number of jobs submitted but not done yet
+    bool _stopping = false;
+
+    process_group _group;  // accessed only from _thread (except for interrupt())
+    std::thread _thread;
+
+    void _run();  // run in _thread.
+    void _launch(_slot& slot, size_t i);  // launch slot.job in slot i.
+    void _done(_slot& slot, result&& r);
+
+    static int _tmpfile();  // create a temporary file without name.
+    static std::string _read(int fd);  // read whole temporary file and close it.
+};
+
+process_pool::process_pool(size_t concurrency, std::vector<process::options> slots)
+:   _concurrency { concurrency > 0 ? concurrency : 1 },
+    _slots { std::move(slots) },
+    _thread { &process_pool::_run, this }
+{}
+
+process_pool::process_pool(size_t concurrency, const std::vector<int>& cpus)
+:   process_pool(concurrency, [&cpus]() {
+	std::vector<process::options> slots(cpus.size());
+	for ( size_t i = 0 ; i < cpus.size() ; ++i )
+	    slots[i].cpus = { cpus[i] };
+	return slots;
+    }())
+{}
+
+process_pool::~process_pool()
+{
+    {
+	std::lock_guard<std::mutex> lock(_mtx);
+	_stopping = true;
+    }
+    _cv.notify_all();
+    _thread.join();
+}
+
+template <typename Bool, typename>
+std::future<process_pool::result> process_pool::submit(
+    std::vector<std::string> argv, Bool capture)
+{
+    const auto promise = std::make_shared<std::promise<result>>();
+    submit(std::move(argv),
+	[promise](result&& r){ promise->set_value(std::move(r)); }, capture);
+    return promise->get_future();
+}
+
+void process_pool::submit(std::vector<std::string> argv,
+    std::function<void(result&&)> callback, bool capture)
+{
+    {
+	std::lock_guard<std::mutex> lock(_mtx);
+	_jobs.push_back({ std::move(argv), std::move(callback), capture });
+	++_pending;
+    }
+    _cv.notify_all();
+    _group.interrupt();  // to have dispatcher launch it right away if any slot is free.
+}
+
+void process_pool::wait()
+{
+    std::unique_lock<std::mutex> lock(_mtx);
+    _cv.wait(lock, [this]{ return _pending == 0; });
+}
+
+void process_pool::_run()
+{
+    std::vector<_slot> slots(_concurrency);
+    size_t running = 0;
+
+    for ( ;; ) {
+	{
+	    std::unique_lock<std::mutex> lock(_mtx);
+	    _cv.wait(lock, [&]{ return !_jobs.empty() || running > 0 || _stopping; });
+	    if ( _jobs.empty() && running == 0 )  // and _stopping
+		break;
+
+	    for ( size_t i = 0 ; i < _concurrency && !_jobs.empty() ; ++i )
+		if ( !slots[i].p ) {
+		    slots[i].job = std::move(_jobs.front());
+		    _jobs.pop_front();
+
+		    lock.unlock();  // to launch without blocking submit().
+		    _launch(slots[i], i);
+		    lock.lock();
+		    if ( slots[i].p )
+			++running;
+		}
+	}
+
+	if ( running > 0 )
+	    if ( process* const p = _group.wait_any() )  // or nullptr if interrupted
+		for ( auto& slot: slots )
+		    if ( slot.p == p ) {
+			result r;
+			r.exitcode = p->exitcode;
+			r.usage = p->usage;
+			if ( slot.job.capture ) {
+			    r.out = _read(slot.out);
+			    r.err = _read(slot.err);
+			    slot.out = slot.err = -1;
+			}
+
+			_group.erase(*p);
+			slot.p = nullptr;
+			--running;
+
+			_done(slot, std::move(r));
+			break;
+		    }
+    }
+}
+
+void process_pool::_launch(_slot& slot, size_t i)
+{
+    int error;
+    try {
+	std::vector<const char*> argv;
+	for ( const auto& each: slot.job.argv )
+	    argv.push_back(each.c_str());
+	argv.push_back(nullptr);
+
+	if ( slot.job.capture ) {
+	    slot.out = _tmpfile();
+	    slot.err = _tmpfile();
+	}
+
+	// process closes neither slot.out nor slot.err, which are then left to us.
+	static const process::options none;
+	process& p = _group.emplace_back(process {
+	    process::DEVNULL, argv.data(),
+	    slot.job.capture ? slot.out : process::DEVNULL,
+	    slot.job.capture ? slot.err : process::DEVNULL,
+	    _slots.empty() ? none : _slots[i % _slots.size()] });
+
+	slot.p = &p;
+	return;
+    }
+    catch ( const std::system_error& e ) {
+	error = e.code().value();
+    }
+    catch ( const std::bad_alloc& ) {
+	error = ENOMEM;
+    }
+    catch ( const std::exception& ) {
+	error = EINVAL;
+    }
+
+    ::close(slot.out);
+    ::close(slot.err);
+    slot.out = slot.err = -1;
+
+    result r;
+    r.error = error;
+    _done(slot, std::move(r));
+}
+
+void process_pool::_done(_slot& slot, result&& r)
+{
+    try {
+	if ( slot.job.callback )
+	    slot.job.callback(std::move(r));
+    }
+    catch ( ... ) {
+	// ignored, since there is no one to report it to on the dispatcher thread.
+    }
+    slot.job = _job {};
+
+    {
+	std::lock_guard<std::mutex> lock(_mtx);
+	--_pending;
+    }
+    _cv.notify_all();
+}
+
+int process_pool::_tmpfile()
+{
+    const char* dir = std::getenv("TMPDIR");
+    if ( !dir || !*dir )
+	dir = "/tmp";
+
+    int fd = ::open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if ( fd == -1 ) {
+	// O_TMPFILE is not supported by file system, so we create a file and unlink it.
+	std::string path = std::string(dir) + "/process_pool.XXXXXX";
+	fd = ::mkostemp(&path[0], O_CLOEXEC);
+	if ( fd == -1 )
+	    throw std::system_error(errno, std::system_category());
+	::unlink(path.c_str());
+    }
+
+    return fd;
+}
+
+std::string process_pool::_read(int fd)
+{
+    std::string s;
+
+    char buf[BUFSIZ];
+    ssize_t n;
+    for ( off_t offset = 0 ; (n = ::pread(fd, buf, sizeof(buf), offset)) > 0 ; offset += n )
+	s.append(buf, n);
+
+    ::close(fd);
+    return s;
+}
@@ -0,0 +1,403 @@
+// reaper: a single thread that waits for and reaps all child processes adopted by it
+//
+// Once a process is adopted by reaper, no threads calling wait(), wait(timeout), or 
+// poll() on the process will call ::waitpid() any longer, but they simply wait (on 
+// futex) for reaper to publish the exitcode of child process. This way, 
+// waiting for thousands of child processes takes only one thread, and the exit of each 
+// child process gets noticed as soon as it happens, not depending on how often it is 
+// polled.
+//
+// - reaper::adopt(p) has reaper wait for p from now on. It does nothing if p is done 
+//   running already, or if some thread is waiting for p right now. (In the latter case, 
+//   that thread will reap the child process as usual.)
+// - Adopted process can be moved and destroyed as usual. If destroyed before child 
+//   process terminates, reaper still reaps the child process when it terminates, so the 
+//   child process is not left behind as a defunct process.
+// - reaper::adopt(p, timeout, grace) also sets a deadline for p: if p is still running 
+//   after timeout, reaper sends SIGTERM to it, and then SIGKILL if still running after 
+//   grace, which is recorded in p.killed along with p.exitcode. If p leads a process 
+//   group (of process::options::pgid = 0), the whole group is signaled instead.
+// - reaper::adopt(ps, timeout, grace) does the same for all of ps (e.g, processes of a 
+//   pipeline) at once, signaling them (or their process groups) together at the 
+//   deadline.
+// - reaper uses epoll on pidfds of child processes, or polls them with short sleeps in a 
+//   busy loop if pidfds are not supported (on Linux < 5.3).
+//
+// Deadlines are kept in a heap, with a timerfd in the epoll set armed for the earliest 
+// one. So, timeouts of thousands of child processes take no threads of their own, and 
+// setting each costs O(log n).
+
+
+
+#pragma once
+
+#include "process.hpp"
+// <algorithm>: find(), remove()
+// <atomic>: atomic<>
+// <mutex>: mutex, lock_guard<>
+// <system_error>: system_error(), system_category(), errno
+// <thread>: thread, .join()
+// <sys/wait.h>: wait4(), WNOHANG
+
+#include <unordered_map>  // unordered_map<>, .emplace(), .find(), .erase()
+#include <queue>  // priority_queue<>, .push(), .top(), .pop()
+#include <functional>  // greater<>
+#include <initializer_list>  // initializer_list<>
+
+extern "C" {
+#include <sys/epoll.h>  // epoll_create1(), epoll_ctl(), epoll_wait()
+#include <sys/eventfd.h>  // eventfd()
+#include <sys/timerfd.h>  // timerfd_create(), timerfd_settime(), TFD_TIMER_ABSTIME
+}
+
+
+
+class reaper: private process_handle::_adopter {
+public:
+    // have reaper wait for p from now on, returning p.
+    static process_handle& adopt(process_handle& p);
+    static process& adopt(process& p)
+    { adopt(static_cast<process_handle&>(p)); return p; }
+
+    // have reaper wait for p, and terminate p if still running after timeout, sending 
+    // SIGTERM, and then SIGKILL after grace, returning p.
+    static process_handle& adopt(process_handle& p,
+	const std::chrono::milliseconds& timeout,
+	const std::chrono::milliseconds& grace =std::chrono::seconds(5))
+    { adopt({ &p }, timeout, grace); return p; }
+    static process& adopt(process& p, const std::chrono::milliseconds& timeout,
+	const std::chrono::milliseconds& grace =std::chrono::seconds(5))
+    { adopt({ &p }, timeout, grace); return p; }
+
+    // the same for all of ps together, with a single deadline.
+    static void adopt(std::initializer_list<process_handle*> ps,
+	const std::chrono::milliseconds& timeout,
+	const std::chrono::milliseconds& grace =std::chrono::seconds(5))
+    { adopt(ps.begin(), ps.size(), timeout, grace); }
+    static void adopt(process_handle* const* ps, size_t n,
+	const std::chrono::milliseconds& timeout,
+	const std::chrono::milliseconds& grace =std::chrono::seconds(5));
+
+private:
+    using time_point = std::chrono::steady_clock::time_point;
+
+    struct _child {
+	process_handle* p;  // nullptr if process object has been destroyed
+	int pidfd;  // -1 if not supported
+	uint64_t deadline;  // id of _targets that child is in, or 0 if none
+    };
+
+    std::mutex _mtx;  // mutex protecting the members below and publishing to _children
+    std::unordered_map<pid_t, _child> _children;
+    std::atomic<int> _unwatched { 0 };
+	// number of _children with pidfd == -1, read by _thread without _mtx locked
+
+    struct _target {  // what gets signaled at a deadline
+	std::vector<pid_t> pids;  // of _children not reaped yet
+	std::vector<pid_t> pgids;  // process groups led by them, while not reaped yet
+	std::chrono::milliseconds grace;
+    };
+    std::unordered_map<uint64_t, _target> _targets;  // by id of deadline
+    uint64_t _last_id = 0;
+
+    struct _deadline {
+	time_point when;
+	uint64_t id;  // of _targets
+	int sig;  // SIGTERM, or SIGKILL once the grace is over
+	bool operator>(const _deadline& d) const { return when > d.when; }
+    };
+    std::priority_queue<_deadline, std::vector<_deadline>, std::greater<>> _deadlines;
+	// _deadlines of _targets erased are just discarded when they come.
+
+    const int _epfd;	// epoll set of pidfds in _children, _wakeup, and _timer
+    const int _wakeup;	// eventfd to wake up _thread
+    const int _timer;	// timerfd armed for the top of _deadlines
+    std::atomic<bool> _stopping { false };
+    std::thread _thread;
+
+    reaper();
+    ~reaper();
+
+    template <typename =void>  // bogus template to have the definition in .hpp
+    static reaper& _instance();  // will be created lazily at the first adopt().
+
+    void _run();  // run in _thread.
+    bool _reap(pid_t pid);  // reap child process if terminated, and publish to process.
+
+    // have reaper wait for p (with _mtx locked), returning false if not adopted.
+    bool _adopt(process_handle& p, uint64_t deadline);
+
+    // signal _targets of _deadlines that have come, and arm _timer for the next one.
+    void _expire();
+    void _arm();
+
+    void _forget(process_handle& p) override;
+    void _moved(process_handle& from, process_handle& to) override;
+};
+
+reaper::reaper()
+:   _epfd { ::epoll_create1(EPOLL_CLOEXEC) },
+    _wakeup { ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK) },
+    _timer { ::timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK) }
+	// CLOCK_MONOTONIC is the clock of std::chrono::steady_clock on Linux.
+{
+    if ( _epfd == -1 || _wakeup == -1 || _timer == -1 ) {
+	const int error = errno;
+	::close(_epfd);
+	::close(_wakeup);
+	::close(_timer);
+	throw std::system_error(error, std::system_category());
+    }
+
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.u64 = 0;  // pid of 0 for _wakeup
+    ::epoll_ctl(_epfd, EPOLL_CTL_ADD, _wakeup, &ev);
+    ev.data.u64 = static_cast<uint64_t>(-1);  // pid of -1 for _timer
+    ::epoll_ctl(_epfd, EPOLL_CTL_ADD, _timer, &ev);
+
+    _thread = std::thread { &reaper::_run, this };
+}
+
+reaper::~reaper()
+{
+    _stopping = true;
+    const uint64_t one = 1;
+    ::write(_wakeup, &one, sizeof(one));
+    _thread.join();
+
+    // Processes still running are left to be waited for as usual, no longer pointing to 
+    // us.
+    for ( const auto& each: _children ) {
+	if ( process_handle* const p = each.second.p ) {
+	    p->_adopted_by.store(nullptr, std::memory_order_release);
+	    p->_publish(process_handle::ALONE);
+	}
+	::close(each.second.pidfd);
+    }
+    ::close(_epfd);
+    ::close(_wakeup);
+    ::close(_timer);
+}
+
+template <typename>
+reaper& reaper::_instance()
+{
+    static reaper instance;
+    return instance;
+}
+
+process_handle& reaper::adopt(process_handle& p)
+{
+    reaper& r = _instance();
+
+    std::lock_guard<std::mutex> lock(r._mtx);
+    r._adopt(p, 0);
+    return p;
+}
+
+void reaper::adopt(process_handle* const* ps, size_t n,
+    const std::chrono::milliseconds& timeout, const std::chrono::milliseconds& grace)
+{
+    reaper& r = _instance();
+
+    std::lock_guard<std::mutex> lock(r._mtx);
+
+    const uint64_t id = ++r._last_id;
+    _target target { {}, {}, grace };
+    for ( size_t i = 0 ; i < n ; ++i )
+	if ( r._adopt(*ps[i], id) ) {
+	    // Child process has set its process group before exec*(), so getpgid() tells 
+	    // if it leads one.
+	    const pid_t pid = ps[i]->_pid;
+	    target.pids.push_back(pid);
+	    if ( ::getpgid(pid) == pid )
+		target.pgids.push_back(pid);
+	}
+    if ( target.pids.empty() )
+	return;  // all done running already (or being waited for by other threads)
+
+    r._targets.emplace(id, std::move(target));
+    const auto when = std::chrono::steady_clock::now() + timeout;
+    r._deadlines.push(_deadline { when, id, SIGTERM });
+    if ( r._deadlines.top().id == id )
+	r._arm();
+}
+
+bool reaper::_adopt(process_handle& p, uint64_t deadline)
+{
+    if ( !p._await() )
+	return false;
+
+    // Reaper is now the one waiting for p. Having had p._running == ALONE, nobody is 
+    // waiting for the child process and the child process has not been reaped, so its 
+    // pid is still valid for pidfd_open().
+    int pidfd = -1;
+#ifdef SYS_pidfd_open
+    pidfd = ::syscall(SYS_pidfd_open, p._pid, 0);
+#endif
+    _children.emplace(p._pid, _child { &p, pidfd, deadline });
+
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.u64 = static_cast<uint64_t>(p._pid);
+    if ( pidfd == -1 || ::epoll_ctl(_epfd, EPOLL_CTL_ADD, pidfd, &ev) == -1 ) {
+	// to be polled by reaper periodically instead
+	::close(pidfd);
+	_children[p._pid].pidfd = -1;
+	if ( _unwatched++ == 0 ) {
+	    const uint64_t one = 1;
+	    ::write(_wakeup, &one, sizeof(one));
+		// to have _thread start polling with a timeout.
+	}
+    }
+
+    p._adopted_by.store(this, std::memory_order_release);
+    return true;
+}
+
+void reaper::_run()
+{
+    using namespace std::chrono_literals;
+    std::chrono::milliseconds dt = 1ms;  // for polling, if _unwatched > 0
+
+    struct epoll_event events[64];
+    while ( !_stopping ) {
+	const int n = ::epoll_wait(_epfd, events, 64, _unwatched > 0 ? dt.count() : -1);
+
+	std::lock_guard<std::mutex> lock(_mtx);
+	for ( int i = 0 ; i < n ; ++i )
+	    if ( events[i].data.u64 == 0 ) {
+		uint64_t count;
+		::read(_wakeup, &count, sizeof(count));
+	    }
+	    else if ( events[i].data.u64 == static_cast<uint64_t>(-1) ) {
+		uint64_t count;
+		::read(_timer, &count, sizeof(count));
+		_expire();
+	    }
+	    else
+		_reap(static_cast<pid_t>(events[i].data.u64));
+
+	if ( _unwatched > 0 ) {
+	    bool reaped = false;
+	    for ( auto it = _children.begin() ; it != _children.end() ; ) {
+		const auto each = it++;  // since _reap() will erase each.
+		if ( each->second.pidfd == -1 && _reap(each->first) )
+		    reaped = true;
+	    }
+	    dt = ( reaped ? 1ms : std::min(dt * 2, std::chrono::milliseconds(64ms)) );
+	}
+    }
+}
+
+bool reaper::_reap(pid_t pid)
+{
+    int status;
+    struct rusage ru;
+    const int wpid = ::wait4(pid, &status, WNOHANG, &ru);
+    if ( wpid == 0 )
+	return false;  // still running
+
+    const auto it = _children.find(pid);
+    if ( it == _children.end() )
+	return false;
+
+    if ( process_handle* const p = it->second.p ) {
+	if ( wpid != -1 )
+	    p->_reaped(status, ru);
+	//else: Possibly, SIGCHLD's signal action is set to SIG_IGN explicitly.
+	p->_adopted_by.store(nullptr, std::memory_order_release);
+	    // before publishing, after which p may be moved or destroyed any time (e.g, 
+	    // during static destruction after reaper is gone).
+	p->_publish(process_handle::DONE);
+    }
+
+    if ( it->second.pidfd == -1 )
+	--_unwatched;
+    else
+	::close(it->second.pidfd);  // will also remove it from _epfd.
+
+    const auto target = _targets.find(it->second.deadline);
+    if ( target != _targets.end() ) {
+	auto& pids = target->second.pids;
+	pids.erase(std::find(pids.begin(), pids.end(), pid));
+	// Once its leader is reaped, the process group may be gone and its pgid reused.
+	auto& pgids = target->second.pgids;
+	pgids.erase(std::remove(pgids.begin(), pgids.end(), pid), pgids.end());
+	if ( pids.empty() )
+	    _targets.erase(target);  // Its _deadlines will be discarded.
+    }
+
+    _children.erase(it);
+    return true;
+}
+
+void reaper::_expire()
+{
+    const auto now = std::chrono::steady_clock::now();
+    for ( ; !_deadlines.empty() && _deadlines.top().when <= now ; _deadlines.pop() ) {
+	const _deadline& d = _deadlines.top();
+	const auto it = _targets.find(d.id);
+	if ( it == _targets.end() )
+	    continue;  // All reaped already.
+	const _target& target = it->second;
+
+	// Signaling children not reaped yet is safe, whose pids cannot be reused by 
+	// others. So is signaling a process group whose leader is one of them (since the 
+	// pgid of a group is the pid of its leader), but not once the leader is reaped, 
+	// which _reap() drops from pgids then.
+	for ( pid_t pgid: target.pgids )
+	    ::kill(-pgid, d.sig);
+	for ( pid_t pid: target.pids ) {
+	    ::kill(pid, d.sig);  // in case it has left its process group since.
+	    if ( process_handle* const p = _children[pid].p )
+		p->_killed = d.sig;
+	}
+
+	if ( d.sig == SIGTERM )
+	    _deadlines.push(_deadline { now + target.grace, d.id, SIGKILL });
+    }
+
+    _arm();
+}
+
+void reaper::_arm()
+{
+    // The timer is disarmed by it_value of 0 if no deadlines are left.
+    struct itimerspec its = {};
+    if ( !_deadlines.empty() ) {
+	const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+	    _deadlines.top().when.time_since_epoch()).count();
+	its.it_value.tv_sec = ns / 1000000000;
+	its.it_value.tv_nsec = ns % 1000000000;
+	if ( ns <= 0 )
+	    its.it_value.tv_nsec = 1;  // not to disarm it
+    }
+    ::timerfd_settime(_timer, TFD_TIMER_ABSTIME, &its, nullptr);
+}
+
+void reaper::_forget(process_handle& p)
+{
+    std::lock_guard<std::mutex> lock(_mtx);
+
+    const auto it = _children.find(p._pid);
+    if ( it != _children.end() && it->second.p == &p )
+	it->second.p = nullptr;  // but will keep watching pid to reap it anyway.
+}
+
+void reaper::_moved(process_handle& from, process_handle& to)
+{
+    std::lock_guard<std::mutex> lock(_mtx);
+
+    to._running  = from._running.load();
+    to._exitcode = from._exitcode;
+    to._killed   = from._killed;
+    to._take_usage(from);
+    to._adopted_by.store(from._adopted_by.load(std::memory_order_relaxed),
+	std::memory_order_release);
+
+    const auto it = _children.find(from._pid);
+    if ( it != _children.end() && it->second.p == &from )
+	it->second.p = &to;
+}
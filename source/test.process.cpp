@@ -4,7 +4,24 @@
 
 #include "process.hpp"
 #include "fdstream.hpp"
+#include "reaper.hpp"
+#include "process_group.hpp"
+#include "process_pool.hpp"
+#include "pipeline.hpp"
+#include "forward.hpp"
+#include "lines.hpp"
+#include "capture.hpp"
+#include "command.hpp"
+#include "zygote.hpp"
+#include "instrument.hpp"
+#include "mapping.hpp"
+#include "coprocess.hpp"
+#include "environment.hpp"
+#include "async_writer.hpp"
+#include "uring.hpp"
+#include "coroutine.hpp"
 #include <iostream>
+#include <unordered_map>
 
 #if 0  // simple command
 int main()
@@ -92,6 +109,31 @@ int main()
 }
 #endif
 
+#if 0  // spawn without copying page tables of parent process
+int main()
+{
+    process::backend = process::VFORK;
+    process { { "ls", "-l" }, process::STDERR, process::STDOUT }.wait();
+    // Redirections work the same as with process::FORK.
+}
+#endif
+
+#if 0  // spawn from a fork server started early
+int main()
+{
+    zygote::start();  // while we are still small, setting process::backend to ZYGOTE.
+
+    std::vector<std::string> heap(1000000, std::string(100, '*'));  // 100MB+ later on
+
+    process proc { { "sh", "-c", "echo child of $PPID" }, process::PIPE };
+    std::cout << process::read_all(proc.stdout);  // pid of ours, not of zygote
+    proc.wait();
+    std::cout << getpid() << " waited w/exitcode=" << proc.exitcode << "\n";
+
+    zygote::stop();
+}
+#endif
+
 #if 0  // piped output
 int main()
 {
@@ -106,6 +148,19 @@ int main()
 }
 #endif
 
+#if 0  // piped output by lines without copying
+int main()
+{
+    process proc { { "ls", "-l" }, process::PIPE };
+
+    for ( std::string_view s: lines(proc.stdout) )
+	std::cout << '[' << s << "]\n";
+	// s refers to the buffer of lines, valid only until the next line is read.
+
+    proc.wait();
+}
+#endif
+
 #if 0  // piped output with stdout and stderr combined
 int main()
 {
@@ -152,6 +207,147 @@ int main()
 }
 #endif
 
+#if 0  // piped input and output without deadlock
+int main()
+{
+    process proc { process::PIPE, { "sort" }, process::PIPE, process::PIPE };
+
+    std::string input;
+    for ( int i = 0 ; i < 1000000 ; ++i )
+	input += "line " + std::to_string(i) + "\n";
+	// which is far bigger than the pipe buffer.
+
+    std::string out, err;
+    proc.communicate(input, out, err);
+    std::cout << out.size() << " bytes sorted w/exitcode=" << proc.exitcode << "\n";
+}
+#endif
+
+#if 0  // piped input written in background
+int main()
+{
+    process proc { process::PIPE, { "sort" }, process::STDOUT };
+    async_writer w { proc.stdin };
+
+    std::vector<std::string> records;
+    for ( int i = 0 ; i < 100000 ; ++i )
+	records.push_back("line " + std::to_string(i) + "\n");
+    for ( const auto& r: records )
+	w.write(r);  // queued without copying, and written in a far fewer ::writev()s.
+
+    w.close();  // after all queued is written. (records should be kept valid until then.)
+    proc.wait();
+}
+#endif
+
+#if 0  // capture output and exitcode
+int main()
+{
+    auto [out, err, exitcode] = capture { "ls", "-l", "/nonexistent", "/" };
+    std::cout << out.size() << " bytes, " << err.size() << " bytes to stderr, exitcode="
+	<< exitcode << "\n";
+
+    process proc { { "ls", "-l" }, process::PIPE };
+    std::string s = process::read_all(proc.stdout);
+	// read directly into s, without going through ifdstream 8KB at a time.
+    proc.wait();
+    std::cout << s;
+}
+#endif
+
+#if 0  // resources used by child processes
+int main()
+{
+    process proc { "sh", "-c", "for i in $(seq 100000); do :; done" };
+    proc.wait();
+    std::cout << "user " << proc.usage.user.count() << "us, sys "
+	<< proc.usage.system.count() << "us, maxrss " << proc.usage.maxrss << "KB, ran "
+	<< proc.usage.runtime.count() << "us\n";
+
+    pipeline p = cmd{ "seq", "1000000" } | cmd{ "sort", "-r" } | cmd{ "head", "-1" };
+    p.wait();
+    std::cout << "pipeline took " << p.usage().user.count() << "us of user CPU in total\n";
+}
+#endif
+
+#if 0  // latency histograms (with -DPROCESS_INSTRUMENT)
+int main()
+{
+    instrument::sink([](instrument::stage s, std::chrono::nanoseconds elapsed) {
+	if ( s == instrument::EXEC )
+	    std::cout << "exec'ed in " << elapsed.count() / 1000 << "us\n"; });
+
+    for ( int i = 0 ; i < 10 ; ++i ) {
+	process proc { { "ls", "-l" }, process::PIPE };
+	process::read_all(proc.stdout);  // noticed for FIRST_BYTE and END
+	proc.wait();
+    }
+
+    std::string metrics;
+    instrument::dump(metrics);  // in the Prometheus text format
+    std::cout << metrics;
+}
+#endif
+
+#if 0  // command prepared once and spawned many times
+int main()
+{
+    command cmd { { "sh", "-c", "echo $GREETING from $(pwd)" }, process::PIPE };
+    cmd.env({ "GREETING=hello" }).cwd("/tmp");
+
+    for ( int i = 0 ; i < 3 ; ++i ) {
+	process proc { cmd };  // with no allocation for argv, envp, or anything else
+	std::cout << process::read_all(proc.stdout);
+	proc.wait();
+    }
+
+    static constexpr argv_literal ls { "ls", "-l" };  // argv built at compile time
+    process { process::DEVNULL, ls.argv, process::STDOUT, process::DEVNULL }.wait();
+}
+#endif
+
+#if 0  // environment and working directory without shell
+int main()
+{
+    // Built once and reused by every spawn below, instead of "cd /tmp && LANG=C ..." 
+    // through /bin/sh -c.
+    environment env { { "LANG=C", "TZ=UTC", "HISTFILE" } };
+    process::options opts;
+    opts.envp = env.envp();
+    opts.cwdfd = ::open("/tmp", O_PATH | O_DIRECTORY | O_CLOEXEC);
+
+    for ( const char* cmd: { "date", "pwd", "locale" } )  // in UTC, in /tmp, and of C
+	process { { cmd }, process::STDOUT, process::STDERR, opts }.wait();
+    ::close(opts.cwdfd);
+}
+#endif
+
+#if 0  // pipe capacity
+int main()
+{
+    process::options opts;
+    opts.capacity[process::STDOUT] = 1024 * 1024;  // 1MB instead of 64KB by default
+
+    process proc { { "cat", "/dev/zero" }, process::PIPE, process::DEVNULL, opts };
+    std::cout << "granted " << process::capacity(proc.stdout) << " bytes\n";
+
+    proc.kill();
+    proc.wait();
+}
+#endif
+
+#if 0  // output into memory file
+int main()
+{
+    process proc { { "seq", "10000000" }, process::MEMFD };
+    proc.wait();  // without reading anything while child is writing
+
+    const mapping out { proc.stdout };
+    const std::string_view s = out.view();  // no copy of the 78MB output
+    std::cout << s.size() << " bytes, last line: " << s.substr(s.rfind('\n', s.size() - 2));
+}
+#endif
+
 #if 0  // constructor syntax
 int main()
 {
@@ -198,6 +394,19 @@ int main()
 }
 #endif
 
+#if 0  // pipeline of cmds
+int main()
+{
+    pipeline p {
+	cmd{ "ls", "-l" } | cmd{ "sort", "-n", "-k5" } | cmd{ "grep", "cpp" },
+	process::STDOUT
+    };
+
+    p.wait();  // waiting for all the processes, not only for the last one "grep".
+    std::cout << "pipefail=" << p.pipefail() << "\n";
+}
+#endif
+
 #if 0  // Temporary (unbound) process object closes all its unused pipes when destroyed.
 int main()
 {
@@ -390,13 +599,159 @@ int main()
     std::ofstream os { "/tmp/test.txt" };
     if ( os ) {
 	process proc { { "ls", "-l" }, fd(os) };
-	    // ::fd() returns the underlying fd for ifstream/ofstream/fstream.
+	    // ::fd() returns the underlying fd for ifstream/ofstream/fstream 
+	    // (with libstdc++ only).
 	proc.wait();
 	std::cout << "done\n";
     }
 }
 #endif
 
+#if 0  // fdstreams in a container
+int main()
+{
+    std::vector<process> procs;
+    std::vector<ifdstream<>> outs;
+    for ( const char* dir: { "/", "/tmp", "/usr" } ) {
+	procs.push_back(process { { "ls", dir }, process::PIPE });
+	outs.push_back(ifdstream<> { procs.back().stdout, 64 * 1024 });
+	    // moved with its buffer of 64KB, not reallocated
+    }
+
+    for ( auto& is: outs ) {
+	std::string s;
+	int count = 0;
+	while ( getline(is, s) )
+	    ++count;
+	std::cout << count << " entries\n";
+    }
+    for ( auto& proc: procs )
+	proc.wait();
+}
+#endif
+
+#if 0  // forward stdout to a file without copying
+int main()
+{
+    ofdstream<> os { "/tmp/test.txt" };
+    if ( os ) {
+	process proc { { "ls", "-l" }, process::PIPE };
+	std::cout << forward(proc.stdout, os.fd()) << " bytes forwarded\n";
+	    // Data go from the pipe to the file using splice(), not through user space.
+	proc.wait();
+    }
+}
+#endif
+
+#if 0  // fan-out of stdout to multiple processes
+int main()
+{
+    process proc { { "ls", "-l" }, process::PIPE };
+    process sum { process::PIPE, { "md5sum" } };
+    process count { process::PIPE, { "wc", "-l" } };
+    std::cout << fanout(proc.stdout, { sum.stdin, count.stdin, 1 }) << " bytes\n";
+	// Both of sum and count (and stdout) get all the output of proc, which goes no 
+	// faster than the slowest of them reads.
+    ::close(sum.stdin);
+    ::close(count.stdin);
+    proc.wait(), sum.wait(), count.wait();
+}
+#endif
+
+#if 0  // io_uring for outputs and exits of many processes
+int main()
+{
+    uring ring;
+    std::list<process> procs;
+    std::vector<std::string> outs(100);
+    std::atomic<int> read { 0 };
+    for ( auto& out: outs ) {
+	procs.push_back(process { { "ls", "-l" }, process::PIPE });
+	ring.read(procs.back().stdout, out, [&](int) { ++read; });
+	ring.watch(procs.back(), [](int exitcode) {
+	    std::cout << "exitcode=" << exitcode << "\n"; });
+    }
+    ring.submit();  // all at once
+
+    for ( auto& proc: procs )
+	proc.wait();  // The ring has waited for the process and publishes its exitcode.
+    while ( read < 100 )
+	std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	// outs are complete only after done() is called.
+    std::cout << outs[0];
+}
+#endif
+
+#if 0  // process watched by io_uring outliving the ring
+int main()
+{
+    process p { "true" };
+    process running { "sleep", "0.5" };
+    {
+	uring ring;
+	ring.watch(p);
+	ring.watch(running);
+	ring.submit();
+	p.wait();  // published by the ring,
+    }  // which releases running (still to be waited for as usual) when destroyed.
+
+    process q { std::move(p) };  // after the ring is gone
+    process r { std::move(running) };
+    r.wait();
+    std::cout << q.exitcode << " " << r.exitcode << "\n";  // 0 0
+}
+#endif
+
+#if 0  // coroutines awaiting processes (with -std=c++20)
+struct task {  // a minimal coroutine type that starts eagerly and is never awaited
+    struct promise_type {
+	task get_return_object() { return {}; }
+	std::suspend_never initial_suspend() { return {}; }
+	std::suspend_never final_suspend() noexcept { return {}; }
+	void return_void() {}
+	void unhandled_exception() { std::terminate(); }
+    };
+};
+
+std::atomic<int> finished { 0 };
+
+task echo(std::string input)
+{
+    process proc { process::PIPE, { "head", "-n", "1" }, process::PIPE };
+    co_await async_write(proc.stdin, input);
+
+    std::string out;
+    while ( co_await async_read(proc.stdout, out) > 0 )
+	;
+    const int exitcode = co_await proc.async_wait();
+    std::cout << out.size() << " bytes echoed w/exitcode=" << exitcode << "\n";
+    ++finished;
+}
+
+task expire()
+{
+    process proc { "sleep", "10" };
+    reaper::adopt(proc, std::chrono::milliseconds(100));  // to kill it at the deadline
+    const int exitcode = co_await proc.async_wait();
+	// notified of its exit through the ring, while reaper is waiting for it.
+    std::cout << "killed w/exitcode=" << exitcode << "\n";
+    ++finished;
+}
+
+int main()
+{
+    for ( int i = 0 ; i < 100 ; ++i )
+	echo("line " + std::to_string(i) + "\n");
+	    // will be suspended without blocking main thread.
+	// The coroutines are resumed in the thread of default_uring(), since no executor 
+	// is given.
+    expire();
+
+    while ( finished < 101 )
+	std::this_thread::sleep_for(std::chrono::milliseconds(10));
+}
+#endif
+
 #if 0  // defunct process
 int main()
 {
@@ -540,6 +895,158 @@ int main()
 }
 #endif
 
+#if 0  // process handles in a table
+int main()
+{
+    std::unordered_map<pid_t, process_handle> table;
+	// 64 bytes for each process, instead of sizeof(process)
+
+    for ( int i = 1 ; i <= 1000 ; ++i ) {
+	process p { { "sleep", std::to_string(i % 5) } };
+	table[p.pid] = std::move(p);  // by move assignment, leaving p empty.
+    }
+
+    for ( auto& [pid, h]: table )
+	if ( h.poll() )  // once done, poll() is just one atomic load, taking no mutex.
+	    std::cout << pid << " done w/exitcode=" << h.exitcode() << "\n";
+
+    for ( auto& [pid, h]: table )
+	h.wait();
+}
+#endif
+
+#if 0  // reaper
+int main()
+{
+    std::vector<process> procs;
+
+    for ( int i = 1 ; i <= 1000 ; ++i )
+	reaper::adopt(procs.emplace_back(
+	    std::initializer_list<std::string>{ "sleep", std::to_string(i % 5) }));
+	// A single reaper thread waits for all the 1000 processes, while procs can 
+	// still be moved (by reallocation) after being adopted.
+
+    for ( auto& p: procs )
+	p.wait();  // just waits for reaper to publish exitcode of p.
+}
+#endif
+
+#if 0  // deadlines by reaper
+int main()
+{
+    using namespace std::chrono_literals;
+
+    process proc { { "sh", "-c", "trap '' TERM; sleep 10" } };
+    reaper::adopt(proc, 1s, 2s);  // SIGTERM after 1 sec, and SIGKILL 2 secs later
+    proc.wait();
+    std::cout << "exitcode=" << proc.exitcode << " killed=" << proc.killed << "\n";
+
+    // All commands are in a process group, which is signaled as a whole (including 
+    // the grandchild sleep of sh).
+    process::options opts;
+    opts.pgid = 0;
+    pipeline p { process::DEVNULL, cmd{ "sh", "-c", "sleep 10" } | cmd{ "cat" },
+	process::STDOUT, process::STDERR, opts };
+    p.deadline(500ms);
+    p.wait();
+    std::cout << "killed=" << p[0].killed << "," << p[1].killed << "\n";
+}
+#endif
+
+#if 0  // process group
+int main()
+{
+    using namespace std::chrono_literals;
+    process_group group;
+
+    for ( int i = 1 ; i <= 100 ; ++i )
+	group.emplace_back({ "sleep", std::to_string(i % 5) });
+
+    while ( process* p = group.wait_any(1s) )
+	// will return each process as soon as it terminates, or nullptr if none 
+	// terminates within 1 sec.
+	std::cout << p->pid << " done w/exitcode=" << p->exitcode << "\n";
+
+    group.wait_all();
+    std::cout << group.finished().size() << " done\n";
+}
+#endif
+
+#if 0  // process pool
+int main()
+{
+    process_pool pool { 4 };  // runs at most 4 commands at a time.
+
+    auto result = pool.submit({ "ls", "-l" }, true);  // captures stdout and stderr.
+
+    for ( int i = 1 ; i <= 20 ; ++i )
+	pool.submit({ "sleep", "1" }, [i](process_pool::result&& r) {
+	    std::cout << i << " done w/exitcode=" << r.exitcode << "\n"; });
+
+    std::cout << result.get().out;
+    pool.wait();  // will take about 5 secs.
+}
+#endif
+
+#if 0  // coprocess
+int main()
+{
+    // sed serves each line sent with a line back, staying alive between requests.
+    coprocess<> co { { "sed", "-u", "s/^/> /" } };
+    for ( int i = 0 ; i < 5 ; ++i )
+	co.send(std::to_string(i));  // 5 requests in flight at once,
+    std::string_view response;
+    while ( co.receive(response) )  // whose responses come back in order.
+	std::cout << response << "\n";
+
+    // A command that crashes after one request loses the rest, and is spawned again.
+    coprocess<> once { { "sh", "-c", "read x; echo $x; exit 1" } };
+    once.send("a"), once.send("b");
+    std::cout << once.receive(response) << " " << response << "\n";  // 1 a
+    std::cout << once.receive(response) << "\n";  // 0 (lost)
+    once.call("c", response);
+    std::cout << response << " after " << once.restarts() << " restart\n";
+
+    coprocess_pool<> pool { 2, { "sed", "-u", "s/.*/\\U&/" } };
+    std::vector<std::thread> threads;
+    for ( int i = 0 ; i < 4 ; ++i )
+	threads.emplace_back([&pool]() {
+	    auto co = pool.acquire();  // waiting while both are leased
+	    std::string_view upper;
+	    co->call("hello", upper);
+	    std::cout << std::string(upper) + "\n";  // at once
+	});
+    for ( auto& each: threads )
+	each.join();
+}
+#endif
+
+#if 0  // placement of child processes
+int main()
+{
+    process::options opts;
+    opts.cpus = { 0 };	// runs only on CPU 0,
+    opts.mems = { 0 };	// allocating memory only from NUMA node 0,
+    opts.nice = 10;  // at a lower priority,
+    opts.ioclass = process::options::IO_IDLE;  // doing I/O only when disk is idle.
+    opts.policy = SCHED_BATCH;
+
+    process proc { { "sh", "-c", "grep Cpus_allowed_list /proc/self/status; nice" },
+	process::STDOUT, process::STDERR, opts };
+    proc.wait();
+
+    // A pool with half of its slots on NUMA node 0 and the other half on node 1.
+    std::vector<process::options> nodes(2);
+    nodes[0].cpus = { 0, 1 }, nodes[0].mems = { 0 };
+    nodes[1].cpus = { 2, 3 }, nodes[1].mems = { 1 };
+    process_pool pool { 4, nodes };
+    for ( int i = 0 ; i < 8 ; ++i )
+	pool.submit({ "sh", "-c", "grep Cpus_allowed_list /proc/self/status" },
+	    [i](process_pool::result&& r) {
+		std::cout << i << " done w/exitcode=" << r.exitcode << "\n"; });
+}
+#endif
+
 #if 0  // error
 void func(process& proc)
 {
@@ -0,0 +1,600 @@
+// uring: io_uring engine for I/O on pipes of processes and for exit of processes
+//
+// - uring ring; creates an io_uring with a thread of its own that submits operations and 
+//   handles their completions. It throws system_error if io_uring is not supported (or 
+//   not permitted) by system, e.g, ENOSYS before Linux 5.6, in which case the other ways 
+//   (e.g, reaper or process::communicate()) should be used instead.
+// - ring.read(fd, s, done) reads from fd (e.g, proc.stdout) until EOF into s, appending 
+//   to it, and calls done(error) with error of 0 (or errno if failed). ring.read_some() 
+//   does the same but only once, appending what is available at the time (or nothing if 
+//   EOF).
+// - ring.write(fd, data, done) writes all data into fd (e.g, proc.stdin), and calls 
+//   done(error) with error of 0 (or errno, e.g, EPIPE if child closed its stdin). The 
+//   data is not copied, so should be kept valid until done() is called.
+// - ring.watch(p, done) has the ring wait for process p just like reaper::adopt(p) does, 
+//   and calls done(exitcode) when the child process terminates. p.wait() and the others 
+//   keep working as usual, only waiting for the ring to publish the exitcode. It returns 
+//   false (not to call done()) if p is done already or some thread is waiting for it.
+// - ring.notify(p, done) calls done(error) when the child process of p terminates, 
+//   just by polling its pidfd, without reaping it for those waiting for it (e.g, 
+//   reaper), so for p that ring.watch() refuses. p.wait() then returns soon, once they 
+//   publish the exitcode. It returns false if the child has been reaped already, and 
+//   throws system_error if pidfd is not supported (Linux < 5.3).
+// - Operations are queued, and then submitted all at once by ring.submit().
+// - done() is called in the thread of ring, and should not block for long. It may queue 
+//   and submit other operations. s should not be accessed until done() is called.
+// - When ring is destroyed, all operations not completed yet are canceled (calling 
+//   done(ECANCELED)), and processes being watched are left to be waited for as usual.
+//
+// All system calls for reading, writing, and waiting for pidfds are batched into one 
+// ::io_uring_enter() each time the thread of ring waits for completions, including those 
+// for reading on and on until EOF. SIGPIPE is blocked in the thread of ring.
+
+// Reference:
+// - io_uring(7), io_uring_setup(2), io_uring_enter(2)
+// - https://kernel.dk/io_uring.pdf
+
+
+
+#pragma once
+
+#include "process.hpp"
+// <atomic>: atomic<>
+// <mutex>: mutex, lock_guard<>
+// <string>: string
+// <string_view>: string_view
+// <system_error>: system_error(), system_category(), errno
+// <thread>: thread, .join()
+// <vector>: vector<>
+// <sys/wait.h>: wait4(), WNOHANG
+
+#include <cstring>  // memset()
+#include <deque>  // deque<>
+#include <functional>  // function<>
+#include <unordered_map>  // unordered_map<>
+#include <unordered_set>  // unordered_set<>
+
+extern "C" {
+#include <linux/io_uring.h>  // io_uring_params, io_uring_sqe, io_uring_cqe, IORING_*
+#include <sys/eventfd.h>  // eventfd()
+// <sys/mman.h>: mmap(), munmap()
+// <sys/syscall.h>: syscall(), SYS_pidfd_open
+}
+
+
+
+class uring: private process_handle::_adopter {
+public:
+    explicit uring(unsigned entries =256);
+    ~uring();
+
+    uring(const uring&) =delete;
+    uring& operator=(const uring&) =delete;
+
+    // queue reading from fd until EOF into s, calling done(error) at the end.
+    void read(int fd, std::string& s, std::function<void(int error)> done);
+
+    // queue reading from fd once into s, calling done(error) at the end.
+    void read_some(int fd, std::string& s, std::function<void(int error)> done);
+
+    // queue writing all data into fd, calling done(error) at the end.
+    void write(int fd, std::string_view data, std::function<void(int error)> done);
+
+    // wait for p on behalf of all threads, calling done(exitcode) when terminated.
+    bool watch(process_handle& p, std::function<void(int exitcode)> done =nullptr);
+
+    // queue waiting for p to terminate, calling done(error) then, without reaping it.
+    bool notify(process_handle& p, std::function<void(int error)> done);
+
+    // submit all operations queued.
+    void submit();
+
+private:
+    struct _op {
+	enum { READ, READ_SOME, WRITE, POLL, READABLE, WAKEUP } kind;
+	int fd;
+	std::string* s;  // to read into (READ*)
+	size_t size;  // of *s before reading (READ*)
+	size_t chunk;  // to read at a time (READ*)
+	std::string_view data;  // left to write (WRITE)
+	pid_t pid;  // whose pidfd is fd (POLL), which is ours unlike for READABLE
+	std::function<void(int)> done;
+    };
+
+    struct _child {
+	process_handle* p;  // nullptr if process object has been destroyed
+	int pidfd;
+    };
+
+    // the ring, used only in _thread after constructed
+    int _ring = -1;
+    void* _sq_ptr = MAP_FAILED;
+    size_t _sq_size = 0;
+    void* _cq_ptr = MAP_FAILED;
+    size_t _cq_size = 0;
+    io_uring_sqe* _sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+    size_t _sqes_size = 0;
+    unsigned *_sq_head, *_sq_tail, *_sq_array, _sq_mask, _sq_entries;
+    unsigned *_cq_head, *_cq_tail, _cq_mask;
+    io_uring_cqe* _cqes;
+    unsigned _sq_local_tail = 0;
+
+    std::deque<_op*> _backlog;  // to be submitted as soon as SQ has room
+    std::unordered_set<_op*> _inflight;  // submitted and not completed yet
+    uint64_t _wakeup_count;
+    _op _wakeup_op;
+
+    std::mutex _mtx;  // mutex protecting below and publishing to _children
+    std::vector<_op*> _queued;  // by read*(), write(), and watch()
+    std::unordered_map<pid_t, _child> _children;
+    bool _stopping = false;
+
+    const int _wakeup;	// eventfd to wake up _thread
+    std::thread _thread;
+
+    void _close();  // release the ring.
+    io_uring_sqe* _get_sqe();
+    void _prepare(io_uring_sqe* sqe, _op* op);
+    void _complete(_op* op, int res);
+    void _cancel(_op* op);
+    int _enter(unsigned min_complete);
+    void _run();  // run in _thread.
+    void _reap(_op* op);
+
+    void _forget(process_handle& p) override;
+    void _moved(process_handle& from, process_handle& to) override;
+};
+
+uring::uring(unsigned entries)
+:   _wakeup { ::eventfd(0, EFD_CLOEXEC) }
+{
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    _ring = ::syscall(__NR_io_uring_setup, entries, &params);
+    if ( _ring != -1 && !(params.features & IORING_FEAT_RW_CUR_POS) ) {
+	// READ and WRITE at the current position (off = -1, as for pipes) need Linux 5.6 
+	// or later, without which no operation (even for _wakeup) would work.
+	::close(_ring);
+	_ring = -1;
+	errno = ENOSYS;
+    }
+
+    if ( _ring != -1 ) {
+	_sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	_cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+	if ( params.features & IORING_FEAT_SINGLE_MMAP )
+	    _sq_size = _cq_size = std::max(_sq_size, _cq_size);
+	_sq_ptr = ::mmap(nullptr, _sq_size, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, _ring, IORING_OFF_SQ_RING);
+	if ( params.features & IORING_FEAT_SINGLE_MMAP )
+	    _cq_ptr = _sq_ptr;
+	else
+	    _cq_ptr = ::mmap(nullptr, _cq_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, _ring, IORING_OFF_CQ_RING);
+	_sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+	_sqes = static_cast<io_uring_sqe*>(::mmap(nullptr, _sqes_size,
+	    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring, IORING_OFF_SQES));
+    }
+
+    if ( _wakeup == -1 || _ring == -1 || _sq_ptr == MAP_FAILED || _cq_ptr == MAP_FAILED
+	|| _sqes == MAP_FAILED ) {
+	const int error = errno;
+	_close();
+	::close(_wakeup);
+	throw std::system_error(error, std::system_category());
+    }
+
+    char* const sq = static_cast<char*>(_sq_ptr);
+    _sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    _sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    _sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    _sq_mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    _sq_entries = params.sq_entries;
+    _sq_local_tail = *_sq_tail;
+
+    char* const cq = static_cast<char*>(_cq_ptr);
+    _cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    _cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    _cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    _cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+	// CQ has twice as many entries as SQ, and we keep no more operations in flight 
+	// than SQ has, so CQ never overflows.
+
+    _wakeup_op = { _op::WAKEUP, _wakeup, nullptr, 0, 0, {}, 0, nullptr };
+    _backlog.push_back(&_wakeup_op);
+
+    _thread = std::thread { &uring::_run, this };
+}
+
+uring::~uring()
+{
+    {
+	std::lock_guard<std::mutex> lock(_mtx);
+	_stopping = true;
+    }
+    const uint64_t one = 1;
+    ::write(_wakeup, &one, sizeof(one));
+    _thread.join();
+
+    // All POLLs have been canceled by _thread, releasing their processes, but any 
+    // process still left is released here as well, not to be pointing to us any more.
+    for ( auto& each: _children ) {
+	if ( process_handle* const p = each.second.p ) {
+	    p->_adopted_by.store(nullptr, std::memory_order_release);
+	    p->_publish(process_handle::ALONE);
+	}
+	::close(each.second.pidfd);
+    }
+    _children.clear();
+
+    _close();
+    ::close(_wakeup);
+}
+
+void uring::_close()
+{
+    if ( _sqes != MAP_FAILED )
+	::munmap(_sqes, _sqes_size);
+    if ( _cq_ptr != MAP_FAILED && _cq_ptr != _sq_ptr )
+	::munmap(_cq_ptr, _cq_size);
+    if ( _sq_ptr != MAP_FAILED )
+	::munmap(_sq_ptr, _sq_size);
+    ::close(_ring);
+}
+
+void uring::read(int fd, std::string& s, std::function<void(int error)> done)
+{
+    // As each read() on pipe cannot give more than the capacity of pipe, we read by 
+    // that much at a time, not to resize s (filling zeros) much more than read.
+    const int capacity = process::capacity(fd);
+    const size_t chunk = capacity > 64 * 1024 ? capacity : 64 * 1024;
+
+    std::lock_guard<std::mutex> lock(_mtx);
+    _queued.push_back(
+	new _op { _op::READ, fd, &s, s.size(), chunk, {}, 0, std::move(done) });
+}
+
+void uring::read_some(int fd, std::string& s, std::function<void(int error)> done)
+{
+    const int capacity = process::capacity(fd);
+    const size_t chunk = capacity > 64 * 1024 ? capacity : 64 * 1024;
+
+    std::lock_guard<std::mutex> lock(_mtx);
+    _queued.push_back(
+	new _op { _op::READ_SOME, fd, &s, s.size(), chunk, {}, 0, std::move(done) });
+}
+
+void uring::write(int fd, std::string_view data, std::function<void(int error)> done)
+{
+    std::lock_guard<std::mutex> lock(_mtx);
+    _queued.push_back(
+	new _op { _op::WRITE, fd, nullptr, 0, 0, data, 0, std::move(done) });
+}
+
+bool uring::watch(process_handle& p, std::function<void(int exitcode)> done)
+{
+    std::lock_guard<std::mutex> lock(_mtx);
+
+    if ( !p._await() )  // The ring is now the one waiting for p, if true.
+	return false;
+
+    // Having had p._running == ALONE, nobody is waiting for the child process and the 
+    // child process has not been reaped, so its pid is still valid for pidfd_open().
+    int pidfd = -1;
+#ifdef SYS_pidfd_open
+    pidfd = ::syscall(SYS_pidfd_open, p._pid, 0);
+#endif
+    if ( pidfd == -1 ) {
+	const int error = errno;
+	p._publish(process_handle::ALONE);
+	throw std::system_error(error, std::system_category());
+    }
+
+    _children.emplace(p._pid, _child { &p, pidfd });
+    _queued.push_back(
+	new _op { _op::POLL, pidfd, nullptr, 0, 0, {}, p._pid, std::move(done) });
+
+    p._adopted_by.store(this, std::memory_order_release);
+    return true;
+}
+
+bool uring::notify(process_handle& p, std::function<void(int error)> done)
+{
+    // The pidfd is owned by p, which stays open (and refers to the same child process) 
+    // while p keeps the child process, even after reaped by others.
+    errno = ENOSYS;
+    const int pidfd = p._open_pidfd();
+    if ( pidfd == -1 ) {
+	if ( errno == ESRCH )
+	    return false;  // reaped by others already
+	throw std::system_error(errno, std::system_category());
+    }
+
+    std::lock_guard<std::mutex> lock(_mtx);
+    _queued.push_back(
+	new _op { _op::READABLE, pidfd, nullptr, 0, 0, {}, 0, std::move(done) });
+    return true;
+}
+
+void uring::submit()
+{
+    const uint64_t one = 1;
+    ::write(_wakeup, &one, sizeof(one));
+}
+
+io_uring_sqe* uring::_get_sqe()
+{
+    const unsigned head = __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE);
+    if ( _sq_local_tail - head == _sq_entries )
+	return nullptr;  // full
+
+    const unsigned index = _sq_local_tail++ & _sq_mask;
+    _sq_array[index] = index;
+    io_uring_sqe* const sqe = &_sqes[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+void uring::_prepare(io_uring_sqe* sqe, _op* op)
+{
+    sqe->fd = op->fd;
+    sqe->user_data = reinterpret_cast<uint64_t>(op);
+    sqe->off = static_cast<uint64_t>(-1);  // at the current position (as for pipes)
+
+    switch ( op->kind ) {
+    case _op::READ:
+    case _op::READ_SOME: {
+	// We read directly into s, growing its capacity geometrically.
+	std::string& s = *op->s;
+	op->size = s.size();
+	if ( s.capacity() - op->size < op->chunk )
+	    s.reserve(std::max(s.capacity() * 2, op->size + op->chunk));
+	s.resize(op->size + op->chunk);
+	sqe->opcode = IORING_OP_READ;
+	sqe->addr = reinterpret_cast<uint64_t>(&s[op->size]);
+	sqe->len = op->chunk;
+	break;
+    }
+    case _op::WRITE:
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->addr = reinterpret_cast<uint64_t>(op->data.data());
+	sqe->len = op->data.size();
+	break;
+    case _op::POLL:
+    case _op::READABLE:
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->off = 0;  // or EINVAL
+	sqe->poll32_events = POLLIN;
+	break;
+    case _op::WAKEUP:
+	sqe->opcode = IORING_OP_READ;
+	sqe->addr = reinterpret_cast<uint64_t>(&_wakeup_count);
+	sqe->len = sizeof(_wakeup_count);
+	break;
+    }
+}
+
+int uring::_enter(unsigned min_complete)
+{
+    __atomic_store_n(_sq_tail, _sq_local_tail, __ATOMIC_RELEASE);
+    const unsigned to_submit = _sq_local_tail - __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE);
+    return ::syscall(__NR_io_uring_enter, _ring, to_submit, min_complete,
+	min_complete > 0 ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+}
+
+void uring::_run()
+{
+    // Writing into a pipe whose reading end has been closed raises SIGPIPE to the thread 
+    // submitting it, so we block SIGPIPE here and take it out if raised.
+    sigset_t sigpipe;
+    ::sigemptyset(&sigpipe);
+    ::sigaddset(&sigpipe, SIGPIPE);
+    ::pthread_sigmask(SIG_BLOCK, &sigpipe, nullptr);
+    const struct timespec zero = {};
+
+    for ( ;; ) {
+	{
+	    std::lock_guard<std::mutex> lock(_mtx);
+	    if ( _stopping )
+		break;
+	    _backlog.insert(_backlog.end(), _queued.begin(), _queued.end());
+	    _queued.clear();
+	}
+
+	while ( !_backlog.empty() && _inflight.size() < _sq_entries ) {
+	    io_uring_sqe* const sqe = _get_sqe();
+	    if ( !sqe )
+		break;
+	    _op* const op = _backlog.front();
+	    _backlog.pop_front();
+	    _prepare(sqe, op);
+	    _inflight.insert(op);
+	}
+
+	if ( _enter(1) == -1 && errno != EINTR && errno != EAGAIN && errno != EBUSY )
+	    break;  // cannot happen unless the ring is broken.
+	::sigtimedwait(&sigpipe, nullptr, &zero);
+
+	unsigned head = *_cq_head;
+	const unsigned tail = __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE);
+	for ( ; head != tail ; ++head ) {
+	    const io_uring_cqe& cqe = _cqes[head & _cq_mask];
+	    _op* const op = reinterpret_cast<_op*>(cqe.user_data);
+	    const int res = cqe.res;
+	    __atomic_store_n(_cq_head, head + 1, __ATOMIC_RELEASE);
+
+	    if ( op && _inflight.erase(op) )
+		_complete(op, res);
+	}
+    }
+
+    // Cancel all in flight and wait for their completions, since the kernel may keep 
+    // using the buffers (e.g, of strings given to read()) until then.
+    for ( auto it = _inflight.begin() ; it != _inflight.end() ; ) {
+	io_uring_sqe* const sqe = _get_sqe();
+	if ( !sqe ) {
+	    _enter(0);
+	    continue;
+	}
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = reinterpret_cast<uint64_t>(*it++);
+	sqe->user_data = 0;
+    }
+    while ( !_inflight.empty() ) {
+	if ( _enter(1) == -1 && errno != EINTR && errno != EAGAIN && errno != EBUSY )
+	    break;
+	::sigtimedwait(&sigpipe, nullptr, &zero);
+
+	unsigned head = *_cq_head;
+	const unsigned tail = __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE);
+	for ( ; head != tail ; ++head ) {
+	    const io_uring_cqe& cqe = _cqes[head & _cq_mask];
+	    _op* const op = reinterpret_cast<_op*>(cqe.user_data);
+	    const int res = cqe.res;
+	    __atomic_store_n(_cq_head, head + 1, __ATOMIC_RELEASE);
+
+	    if ( op && _inflight.erase(op) ) {
+		if ( op->kind == _op::READ || op->kind == _op::READ_SOME )
+		    op->s->resize(op->size + std::max(res, 0));
+		_cancel(op);
+	    }
+	}
+    }
+
+    _backlog.insert(_backlog.end(), _queued.begin(), _queued.end());
+    _queued.clear();
+    for ( _op* const op: _backlog )
+	_cancel(op);
+}
+
+void uring::_complete(_op* op, int res)
+{
+    switch ( op->kind ) {
+    case _op::READ:
+    case _op::READ_SOME:
+	op->s->resize(op->size + std::max(res, 0));
+	instrument::_read(op->fd, res < 0 ? -1 : res);
+	if ( (res > 0 && op->kind == _op::READ) || res == -EINTR || res == -EAGAIN ) {
+	    _backlog.push_back(op);  // to read more
+	    return;
+	}
+	break;
+    case _op::WRITE:
+	if ( res >= 0 )
+	    op->data.remove_prefix(res);
+	if ( (res >= 0 && !op->data.empty()) || res == -EINTR || res == -EAGAIN ) {
+	    _backlog.push_back(op);  // to write the rest
+	    return;
+	}
+	break;
+    case _op::READABLE:
+	if ( res == -EINTR || res == -EAGAIN ) {
+	    _backlog.push_back(op);  // to poll again
+	    return;
+	}
+	break;
+    case _op::POLL:
+	_reap(op);
+	return;
+    case _op::WAKEUP:
+	if ( res >= 0 || res == -EINTR || res == -EAGAIN )
+	    _backlog.push_back(op);  // to keep watching _wakeup
+	else {
+	    // cannot happen unless the ring is broken, so we stop, not to spin on it.
+	    std::lock_guard<std::mutex> lock(_mtx);
+	    _stopping = true;
+	}
+	return;
+    }
+
+    if ( op->done )
+	op->done(res < 0 ? -res : 0);
+    delete op;
+}
+
+// Discard op without having done it.
+void uring::_cancel(_op* op)
+{
+    switch ( op->kind ) {
+    case _op::READ:
+    case _op::READ_SOME:
+    case _op::WRITE:
+    case _op::READABLE:
+	if ( op->done )
+	    op->done(ECANCELED);
+	break;
+    case _op::POLL: {
+	// Let the process (if still alive) be waited for as usual.
+	std::lock_guard<std::mutex> lock(_mtx);
+	const auto it = _children.find(op->pid);
+	if ( process_handle* const p = it->second.p ) {
+	    p->_adopted_by.store(nullptr, std::memory_order_release);
+	    p->_publish(process_handle::ALONE);
+	}
+	::close(it->second.pidfd);
+	_children.erase(it);
+	break;
+    }
+    case _op::WAKEUP:
+	return;
+    }
+    delete op;
+}
+
+void uring::_reap(_op* op)
+{
+    int exitcode;
+    {
+	std::lock_guard<std::mutex> lock(_mtx);
+
+	int status;
+	struct rusage ru;
+	const int wpid = ::wait4(op->pid, &status, WNOHANG, &ru);
+	if ( wpid == 0 ) {
+	    _backlog.push_back(op);  // still running, to poll again
+	    return;
+	}
+	exitcode = wpid == -1 ? process::UNKNOWN : process_handle::_exitcode_of(status);
+
+	const auto it = _children.find(op->pid);
+	if ( process_handle* const p = it->second.p ) {
+	    if ( wpid != -1 )
+		p->_reaped(status, ru);
+	    p->_adopted_by.store(nullptr, std::memory_order_release);
+		// before publishing, after which p may be moved or destroyed any time, and 
+		// may outlive the ring.
+	    p->_publish(process_handle::DONE);
+	}
+	::close(it->second.pidfd);
+	_children.erase(it);
+    }
+
+    if ( op->done )
+	op->done(exitcode);
+    delete op;
+}
+
+void uring::_forget(process_handle& p)
+{
+    std::lock_guard<std::mutex> lock(_mtx);
+
+    const auto it = _children.find(p._pid);
+    if ( it != _children.end() && it->second.p == &p )
+	it->second.p = nullptr;  // but will keep watching pid to reap it anyway.
+}
+
+void uring::_moved(process_handle& from, process_handle& to)
+{
+    std::lock_guard<std::mutex> lock(_mtx);
+
+    to._running  = from._running.load();
+    to._exitcode = from._exitcode;
+    to._killed   = from._killed;
+    to._take_usage(from);
+    to._adopted_by.store(from._adopted_by.load(std::memory_order_relaxed),
+	std::memory_order_release);
+
+    const auto it = _children.find(from._pid);
+    if ( it != _children.end() && it->second.p == &from )
+	it->second.p = &to;
+}
@@ -0,0 +1,410 @@
+// zygote: a fork server that spawns child processes on behalf of a big parent process
+//
+// fork() gets slower (and riskier) as parent process grows in memory and in number of 
+// threads, which VFORK helps with but only partly. zygote is a small helper process 
+// forked at the beginning, while parent is still small and single-threaded, which then 
+// spawns all child processes for parent:
+// - zygote::start() starts the fork server and sets process::backend to 
+//   process::ZYGOTE, after which process proc { ... }; sends argv, envp, cwd, placement 
+//   (of process::options), and the fds to redirect (with SCM_RIGHTS) to zygote over a 
+//   Unix socket, and zygote spawns child process and reports its pid back.
+// - Child processes are spawned using clone(CLONE_PARENT), so are children of parent 
+//   process, not of zygote. So, proc.wait(), proc.poll(), reaper, uring, ... work as 
+//   usual, and pipes are delivered to child process through zygote as well.
+// - Child process inherits the current environ and working directory of parent process 
+//   (sent at each spawn) unless given by options, but the signal mask of zygote (as of 
+//   zygote::start()).
+// - zygote::stop() stops the fork server, restoring process::backend to process::FORK. 
+//   zygote stops by itself as well when parent process exits.
+//
+// Spawns are serialized over the single socket, each taking a round trip to zygote, 
+// but the cost does not depend on the memory size or number of threads of parent 
+// process any longer.
+
+
+
+#pragma once
+
+#include "process.hpp"
+// <mutex>: mutex, lock_guard<>
+// <string>: string, .append(), .size()
+// <vector>: vector<>, .push_back(), .data()
+// <cstring>: strlen(), memcpy()
+// <system_error>: system_error(), system_category(), errno
+// <unistd.h>: fork(), read(), close(), dup2(), fchdir(), environ 
+// <fcntl.h>: open(), O_PATH, O_DIRECTORY, O_CLOEXEC
+// <sys/wait.h>: waitpid()
+// <signal.h>: sigaction(), SIGINT, SIGQUIT, _NSIG
+// <sched.h>: clone()
+// <sys/mman.h>: mmap()
+// <sys/syscall.h>: syscall(), SYS_close_range, SYS_getdents64
+
+#include <cstdint>  // uint32_t
+
+extern "C" {
+#include <sys/socket.h>  // socketpair(), sendmsg(), recvmsg(), CMSG_*, SCM_RIGHTS
+}
+
+
+
+class zygote {
+public:
+    // start the fork server (if not started yet) and set process::backend to 
+    // process::ZYGOTE, throwing system_error if failed.
+    static void start();
+
+    // stop the fork server (if started), setting process::backend back to process::FORK.
+    static void stop();
+
+    static pid_t pid() { return _pid; }  // of fork server, or 0 if not started
+
+private:
+    static inline std::mutex _mtx;  // mutex for the members below and each spawn
+    static inline int _sock = -1;  // to fork server
+    static inline pid_t _pid = 0;
+
+    struct _request {  // followed by size bytes of the strings below
+	uint32_t size;
+	uint32_t argc;
+	uint32_t envc;
+	bool has_path;
+	bool has_cwd;
+	bool inherit;  // true if envp is our environ.
+	bool has_place;
+	process::_placement place;  // with fds of cgroup and procs sent separately
+	// path (if has_path), cwd (if has_cwd), argv[argc], and envp[envc], each 
+	// terminated by '\0'
+    };
+    enum { NFDS = 6 };
+	// stdin, stdout, stderr, report, our working directory, and cgroup.procs of 
+	// place (or our working directory again if none)
+
+    struct _reply {
+	pid_t pid;  // of child process, or -1 if failed
+	int error;  // errno if failed
+    };
+
+    // send sp to fork server and return pid of child process spawned, or -1 if failed 
+    // (with errno), run in parent process.
+    static pid_t _delegate(process::_spawn& sp);
+
+    // serve requests from sock until parent closes it, running in fork server!
+    [[noreturn]] static void _serve(int sock) noexcept;
+
+    struct _child {  // what child process needs to know from fork server
+	process::_spawn sp;
+	int dirfd;  // working directory of parent to fchdir() into
+	bool inherit;  // true if sp.envp is environ of parent.
+	const sigset_t* ignored;  // signals ignored by parent (of SIGINT and SIGQUIT)
+    };
+
+    // set up what fork server has changed and exec*(), running in child process!
+    static int _child_entry(void* child);
+
+    // close all fds >= lowfd, running in fork server!
+    static void _close_from(int lowfd);
+
+    // read (or write) exactly size bytes, returning false if failed or EOF.
+    static bool _read_fully(int fd, void* buf, size_t size);
+    static bool _write_fully(int fd, const void* buf, size_t size);
+};
+
+void zygote::start()
+{
+    std::lock_guard<std::mutex> lock { _mtx };
+    if ( _sock != -1 )
+	return;
+
+    int sv[2];
+    if ( ::socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1 )
+	throw std::system_error(errno, std::system_category());
+
+    const pid_t pid = ::fork();
+    if ( pid == -1 ) {
+	const int error = errno;
+	::close(sv[0]);
+	::close(sv[1]);
+	throw std::system_error(error, std::system_category());
+    }
+
+    if ( pid == 0 ) {  // run in fork server!
+	// Fork server keeps only stdin/stdout/stderr and its socket, so as not to hold 
+	// pipes (or anything else) of parent open.
+	if ( ::dup2(sv[1], process::STDERR + 1) == -1 )
+	    std::_Exit(127);
+	_close_from(process::STDERR + 2);
+	_serve(process::STDERR + 1);
+    }
+
+    ::close(sv[1]);
+    _sock = sv[0];
+    _pid = pid;
+    process::_zygote.store(_delegate, std::memory_order_release);
+    process::backend = process::ZYGOTE;
+}
+
+void zygote::stop()
+{
+    std::lock_guard<std::mutex> lock { _mtx };
+    if ( _sock == -1 )
+	return;
+
+    if ( process::backend == process::ZYGOTE )
+	process::backend = process::FORK;
+
+    ::close(_sock);  // Fork server exits as soon as it reads EOF.
+    _sock = -1;
+    ::waitpid(_pid, nullptr, 0);
+    _pid = 0;
+}
+
+pid_t zygote::_delegate(process::_spawn& sp)
+{
+    std::lock_guard<std::mutex> lock { _mtx };
+    if ( _sock == -1 )  // stopped since process::backend was read
+	return process::_fork(sp);
+
+    // Child process runs in our working directory (unless in sp.cwdfd), which we send 
+    // as an fd since it can be changed (or even removed) anytime.
+    const int dirfd = sp.cwdfd != -1 ? sp.cwdfd
+	: ::open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if ( dirfd == -1 )
+	return -1;
+
+    const bool inherit = !sp.envp;
+    const char* const* const envp = inherit ? environ : sp.envp;
+
+    _request req { 0, 0, 0, sp.path != nullptr, sp.cwd != nullptr, inherit,
+	sp.place != nullptr, {} };
+    if ( sp.place )
+	req.place = *sp.place;
+    std::string body;
+    const auto put = [&body](const char* s) { body.append(s, std::strlen(s) + 1); };
+    if ( sp.path )
+	put(sp.path);
+    if ( sp.cwd )
+	put(sp.cwd);
+    for ( const char* const* p = sp.argv ; *p ; ++p, ++req.argc )
+	put(*p);
+    for ( const char* const* p = envp ; *p ; ++p, ++req.envc )
+	put(*p);
+    req.size = body.size();
+
+    // The fds are sent along with the header, and received as new fds in fork server.
+    const int procs = sp.place && sp.place->procs != -1 ? sp.place->procs : dirfd;
+    const int fds[NFDS] = { sp.fds[0], sp.fds[1], sp.fds[2], sp.report, dirfd, procs };
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(fds))] = {};
+    iovec iov { &req, sizeof(req) };
+    msghdr msg {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsghdr* const cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    std::memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    ssize_t n;
+    errno = 0;
+    while ( (n = ::sendmsg(_sock, &msg, MSG_NOSIGNAL)) == -1 && errno == EINTR )
+	;
+    _reply reply;
+    if ( n == -1
+	|| !_write_fully(_sock, reinterpret_cast<const char*>(&req) + n, sizeof(req) - n)
+	|| !_write_fully(_sock, body.data(), body.size())
+	|| !_read_fully(_sock, &reply, sizeof(reply)) )
+	reply = { -1, errno ? errno : EPIPE };  // Fork server has gone.
+
+    if ( dirfd != sp.cwdfd )
+	::close(dirfd);
+    if ( reply.pid == -1 )
+	errno = reply.error;
+    return reply.pid;
+}
+
+void zygote::_serve(int sock) noexcept
+{
+    // Signal handlers of parent process are not for us, so we reset them to default, 
+    // but ignore SIGINT and SIGQUIT (e.g, from Ctrl-C in terminal) not to go away before 
+    // parent does. Child processes get them back in _child_entry().
+    sigset_t ignored;
+    ::sigemptyset(&ignored);
+    struct sigaction sa;
+    for ( int sig = 1 ; sig < _NSIG ; ++sig )
+	if ( ::sigaction(sig, nullptr, &sa) == 0 ) {
+	    if ( sa.sa_handler == SIG_IGN )
+		::sigaddset(&ignored, sig);
+	    else if ( sa.sa_handler != SIG_DFL || sig == SIGINT || sig == SIGQUIT ) {
+		::sigemptyset(&sa.sa_mask);
+		sa.sa_flags = 0;
+		sa.sa_handler = sig == SIGINT || sig == SIGQUIT ? SIG_IGN : SIG_DFL;
+		::sigaction(sig, &sa, nullptr);
+	    }
+	}
+
+    // Child process runs on its own copy of this stack (without CLONE_VM), which needs 
+    // to be big enough only for what ::execvpe() puts on it.
+    constexpr size_t stack_size = 64 * 1024;
+    void* const stack = ::mmap(nullptr, stack_size, PROT_READ | PROT_WRITE,
+	MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if ( stack == MAP_FAILED )
+	std::_Exit(127);
+
+    std::vector<char> body;
+    std::vector<const char*> argv, envp;
+    for ( ; ; ) {
+	_request req;
+	alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * NFDS)];
+	iovec iov { &req, sizeof(req) };
+	msghdr msg {};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	ssize_t n;
+	while ( (n = ::recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR )
+	    ;
+	if ( n <= 0 )  // Parent has closed the socket (or exited).
+	    std::_Exit(0);
+
+	int fds[NFDS];
+	int nfds = 0;
+	const cmsghdr* const cmsg = CMSG_FIRSTHDR(&msg);
+	if ( cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS ) {
+	    nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+	    std::memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * nfds);
+	}
+
+	if ( !_read_fully(sock, reinterpret_cast<char*>(&req) + n, sizeof(req) - n) )
+	    std::_Exit(0);  // the rest of header, if any
+	body.resize(req.size);
+	if ( !_read_fully(sock, body.data(), body.size()) )
+	    std::_Exit(0);
+
+	const char* s = body.data();
+	const auto get = [&s]() { const char* const p = s; s += std::strlen(s) + 1; return p; };
+	const char* const path = req.has_path ? get() : nullptr;
+	const char* const cwd = req.has_cwd ? get() : nullptr;
+	argv.clear();
+	for ( uint32_t i = 0 ; i < req.argc ; ++i )
+	    argv.push_back(get());
+	argv.push_back(nullptr);
+	envp.clear();
+	for ( uint32_t i = 0 ; i < req.envc ; ++i )
+	    envp.push_back(get());
+	envp.push_back(nullptr);
+
+	_reply reply { -1, EBADMSG };
+	if ( nfds == NFDS ) {
+	    process::_placement& place = req.place;
+	    if ( place.procs != -1 )
+		place.procs = fds[5];
+	    place.cgroup = -1;  // not sent, nor needed without clone3()
+
+	    _child child { { { fds[0], fds[1], fds[2] }, argv.data(), envp.data(), cwd, -1,
+		path, fds[3], false, {}, req.has_place ? &place : nullptr, false }, fds[4],
+		req.inherit, &ignored };
+
+	    // CLONE_PARENT has child process be a child of parent process, not ours.
+	    reply.pid = ::clone(_child_entry, static_cast<char*>(stack) + stack_size,
+		CLONE_PARENT | SIGCHLD, &child);
+	    reply.error = errno;
+	}
+	for ( int i = 0 ; i < nfds ; ++i )
+	    ::close(fds[i]);
+
+	if ( !_write_fully(sock, &reply, sizeof(reply)) )
+	    std::_Exit(0);
+    }
+}
+
+int zygote::_child_entry(void* child)
+{
+    const _child& c = *static_cast<const _child*>(child);
+
+    struct sigaction sa;
+    ::sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;
+    sa.sa_handler = SIG_DFL;
+    if ( !::sigismember(c.ignored, SIGINT) )
+	::sigaction(SIGINT, &sa, nullptr);
+    if ( !::sigismember(c.ignored, SIGQUIT) )
+	::sigaction(SIGQUIT, &sa, nullptr);
+
+    // execvpe() searches $PATH of our own environ, so have it be parent's if inherited.
+    if ( c.inherit )
+	environ = const_cast<char**>(c.sp.envp);
+
+    if ( ::fchdir(c.dirfd) == -1 )
+	process::_fail(c.sp.report);
+    process::_exec(c.sp);
+}
+
+void zygote::_close_from(int lowfd)
+{
+#ifdef SYS_close_range
+    if ( ::syscall(SYS_close_range, lowfd, ~0U, 0U) == 0 )
+	return;
+#endif
+
+    // Fds are collected first, not to close them while reading /proc/self/fd.
+    std::vector<int> fds;
+    const int dirfd = ::open("/proc/self/fd", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if ( dirfd == -1 )
+	return;
+
+    struct dirent64 {  // as defined in getdents64(2)
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+    };
+    alignas(dirent64) char buf[1024];
+    for ( long n ; (n = ::syscall(SYS_getdents64, dirfd, buf, sizeof(buf))) > 0 ; )
+	for ( long pos = 0 ; pos < n ; ) {
+	    const dirent64* const d = reinterpret_cast<const dirent64*>(buf + pos);
+	    pos += d->d_reclen;
+
+	    int fd = 0;
+	    for ( const char* p = d->d_name ; *p >= '0' && *p <= '9' ; ++p )
+		fd = fd * 10 + (*p - '0');
+	    if ( fd >= lowfd && fd != dirfd )
+		fds.push_back(fd);
+	}
+
+    ::close(dirfd);
+    for ( int fd: fds )
+	::close(fd);
+}
+
+bool zygote::_read_fully(int fd, void* buf, size_t size)
+{
+    for ( char* p = static_cast<char*>(buf) ; size > 0 ; ) {
+	const ssize_t n = ::read(fd, p, size);
+	if ( n == -1 && errno == EINTR )
+	    continue;
+	if ( n <= 0 )
+	    return false;
+	p += n;
+	size -= n;
+    }
+    return true;
+}
+
+bool zygote::_write_fully(int fd, const void* buf, size_t size)
+{
+    for ( const char* p = static_cast<const char*>(buf) ; size > 0 ; ) {
+	const ssize_t n = ::send(fd, p, size, MSG_NOSIGNAL);
+	if ( n == -1 && errno == EINTR )
+	    continue;
+	if ( n == -1 )
+	    return false;
+	p += n;
+	size -= n;
+    }
+    return true;
+}